@@ -0,0 +1,359 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+*
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <getopt.h>
+#include <glob.h>
+#include <math.h>
+#include <time.h>
+
+/*****
+ * Markov benchmark
+ *
+ * Times corpus loading, training (markov_generate_mht and the streaming
+ * markov_train_files) and generation (generate_random_word) on every .txt
+ * data set in data/, then on synthetic corpora whose word frequencies follow
+ * Zipf's law, from 10^3 words up to 10^maxexp. Results are written as JSON,
+ * one object per corpus.
+ *****/
+enum {
+    BENCH_VOCAB  = 100000, // Distinct words in a synthetic corpus, at most
+    BENCH_NAMES  = 100000, // Names generated per corpus
+    BENCH_MAXEXP = 7,      // Largest synthetic corpus is 10^BENCH_MAXEXP words
+    BENCH_SEED   = 12345   // Seed for the synthetic corpora and generation
+};
+
+typedef struct BenchResult BenchResult;
+struct BenchResult {
+    char *corpus;           // File name, or "zipf:1e<exponent>"
+    int words;              // Words in the corpus
+    size_t bytes;           // Size of the corpus file
+    int keys;               // Keys in the trained model
+    double load;            // Seconds to read the corpus into a word list
+    double train;           // Seconds for markov_generate_mht
+    double stream;          // Seconds for markov_train_files
+    int names;              // Names generated
+    long chars;             // Characters in the names generated
+    double gen;             // Seconds for generate_random_word
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_print_help(void) {
+    printf("Usage: markov_bench [-n names] [-k order] [-j threads] [-r rng] [-x maxexp] [-d datadir] [-o outfile]\n");
+    printf("\t[-n names] names generated per corpus (default %d)\n", BENCH_NAMES);
+    printf("\t[-k order] chain order (default %d)\n", KEYSZ);
+    printf("\t[-j threads] training threads (default 1)\n");
+    printf("\t[-r rng] random number generator, xoshiro (default), mt or philox\n");
+    printf("\t[-x maxexp] largest synthetic corpus is 10^maxexp words (default %d, 0 skips them)\n", BENCH_MAXEXP);
+    printf("\t[-d datadir] directory holding the *.txt data sets (default \"data\")\n");
+    printf("\t[-o outfile] writes the JSON results to outfile instead of stdout\n");
+}
+
+static int bench_zipf_corpus(char *fname, int nwords, Rng *rng) {
+    /* Write nwords words to fname, drawn from a vocabulary of made up words
+     * with the frequency of the word ranked r proportional to 1/r (Zipf's
+     * law, exponent 1). Words are 2 to 12 letters, the letters weighted
+     * roughly like English. Returns -1 if the file can't be written. */
+    static const char letters[] = "eeeeeeeeeeeeaaaaaaaaaiiiiiiiiioooooooo"
+        "nnnnnnrrrrrrttttttlllllssssssuuuudddgggbbccmmppffhhvvwwyykjxqz";
+    int nvocab = (nwords < BENCH_VOCAB) ? nwords : BENCH_VOCAB;
+    char **vocab = malloc(sizeof(char*) * nvocab);
+    double *cdf = malloc(sizeof(double) * nvocab);
+    double total = 0;
+    double u = 0;
+    FILE *f = fopen(fname, "w");
+    int len = 0;
+    int lo = 0;
+    int hi = 0;
+    int mid = 0;
+    int i = 0;
+    int j = 0;
+
+    if(!f) {
+        free(vocab);
+        free(cdf);
+        return -1;
+    }
+    for(i = 0; i < nvocab; i++) {
+        len = 2 + rng_below(rng, 11);
+        vocab[i] = malloc(len + 1);
+        for(j = 0; j < len; j++) {
+            vocab[i][j] = letters[rng_below(rng, sizeof(letters) - 1)];
+        }
+        vocab[i][len] = '\0';
+        total += 1.0 / (i + 1);
+        cdf[i] = total;
+    }
+    for(i = 0; i < nwords; i++) {
+        // Inverse of the cumulative distribution, by binary search
+        u = (rng_u32(rng) / 4294967296.0) * total;
+        lo = 0;
+        hi = nvocab - 1;
+        while(lo < hi) {
+            mid = (lo + hi) / 2;
+            if(cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        fputs(vocab[lo], f);
+        fputc((i % 16 == 15) ? '\n' : ' ', f);
+    }
+    fclose(f);
+    for(i = 0; i < nvocab; i++) {
+        free(vocab[i]);
+    }
+    free(vocab);
+    free(cdf);
+    return 0;
+}
+
+static int bench_corpus(BenchResult *r, char *fname, int order, int nthreads,
+        int names) {
+    /* Run every benchmark on one corpus file. Returns -1 (with a message) if
+     * the file can't be read. */
+    Arena *corpus = NULL;
+    SList *words = NULL;
+    SList *tmp = NULL;
+    MHTable *ht = NULL;
+    FILE *f = NULL;
+    Rng rng;
+    double t = 0;
+    int i = 0;
+
+    f = fopen(fname, "r");
+    if(!f) {
+        fprintf(stderr, "Unable to load corpus \"%s\", skipped\n", fname);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    r->bytes = ftell(f);
+    fclose(f);
+
+    corpus = create_arena(ARENASZ);
+    t = bench_now();
+    words = slist_load_dataset_arena(fname, corpus);
+    slist_to_lower(words);
+    r->load = bench_now() - t;
+    r->words = slist_count(words);
+
+    t = bench_now();
+    ht = markov_generate_mht(words, order, nthreads);
+    r->train = bench_now() - t;
+    r->keys = ht->count;
+    destroy_mhtable(ht);
+    destroy_arena(corpus);
+
+    t = bench_now();
+    ht = markov_train_files(&fname, 1, order, nthreads);
+    r->stream = bench_now() - t;
+    if(!ht) {
+        fprintf(stderr, "Unable to train on corpus \"%s\", skipped\n", fname);
+        return -1;
+    }
+
+    rng_seed(&rng, BENCH_SEED, 0);
+    r->names = names;
+    r->chars = 0;
+    t = bench_now();
+    for(i = 0; i < names; i++) {
+        tmp = generate_random_word(ht, &rng, NULL);
+        if(tmp) {
+            r->chars += strlen(tmp->data);
+        }
+        destroy_slist(&tmp);
+    }
+    r->gen = bench_now() - t;
+    destroy_mhtable(ht);
+    return 0;
+}
+
+static void bench_json_string(FILE *f, const char *s) {
+    // s as a quoted JSON string
+    fputc('"', f);
+    for(; *s; s++) {
+        if((*s == '"') || (*s == '\\')) {
+            fprintf(f, "\\%c", *s);
+        } else if((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", (unsigned char)*s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void bench_write(FILE *f, BenchResult *r, bool last) {
+    /* One JSON object per corpus. Rates are per second of wall time, and the
+     * ns/char figures are per character of corpus (training) or per
+     * character generated. */
+    double gen = (r->gen > 0) ? r->gen : 1e-9;
+    double train = (r->train > 0) ? r->train : 1e-9;
+    double stream = (r->stream > 0) ? r->stream : 1e-9;
+    fprintf(f, "    {\"corpus\": ");
+    bench_json_string(f, r->corpus);
+    fprintf(f, ", \"words\": %d, \"bytes\": %zu, \"keys\": %d,\n", r->words,
+            r->bytes, r->keys);
+    fprintf(f, "     \"load_s\": %.6f, \"load_mb_per_s\": %.2f,\n", r->load,
+            r->bytes / 1e6 / ((r->load > 0) ? r->load : 1e-9));
+    fprintf(f, "     \"train_s\": %.6f, \"train_words_per_s\": %.0f, "
+            "\"train_ns_per_char\": %.2f,\n", r->train, r->words / train,
+            r->bytes ? train * 1e9 / r->bytes : 0);
+    fprintf(f, "     \"stream_s\": %.6f, \"stream_words_per_s\": %.0f, "
+            "\"stream_ns_per_char\": %.2f,\n", r->stream, r->words / stream,
+            r->bytes ? stream * 1e9 / r->bytes : 0);
+    fprintf(f, "     \"gen_names\": %d, \"gen_s\": %.6f, "
+            "\"gen_names_per_s\": %.0f, \"gen_ns_per_char\": %.2f}%s\n",
+            r->names, r->gen, r->names / gen,
+            r->chars ? gen * 1e9 / r->chars : 0, last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+    BenchResult *results = NULL;
+    BenchResult *r = NULL;
+    glob_t sets;
+    Rng rng;
+    char *datadir = "data";
+    char *outf = NULL;
+    char pattern[4096];
+    char zipf[] = "/tmp/markov_bench_XXXXXX";
+    char name[64];
+    FILE *out = stdout;
+    int names = BENCH_NAMES;
+    int order = KEYSZ;
+    int nthreads = 1;
+    int maxexp = BENCH_MAXEXP;
+    RngKind kind = RNG_XOSHIRO;
+    int nresults = 0;
+    int nwords = 0;
+    int fd = -1;
+    int c = 0;
+    int i = 0;
+
+    while((c = getopt(argc, argv, "hn:k:j:r:x:d:o:")) != -1) {
+        switch(c) {
+            case 'n':
+                names = atoi(optarg);
+                break;
+            case 'k':
+                order = atoi(optarg);
+                if((order < 1) || (order > KEYMAX)) {
+                    fprintf(stderr, "Order must be 1 to %d.\n", KEYMAX);
+                    return -1;
+                }
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                if(nthreads < 1) nthreads = 1;
+                break;
+            case 'r':
+                if(rng_kind_from_name(optarg, &kind) < 0) {
+                    fprintf(stderr, "Generator must be mt, xoshiro or philox.\n");
+                    return -1;
+                }
+                rng_set_default(kind);
+                break;
+            case 'x':
+                maxexp = atoi(optarg);
+                break;
+            case 'd':
+                datadir = optarg;
+                break;
+            case 'o':
+                outf = optarg;
+                break;
+            default:
+                bench_print_help();
+                return (c == 'h') ? 0 : -1;
+        }
+    }
+
+    snprintf(pattern, sizeof(pattern), "%s/*.txt", datadir);
+    memset(&sets, 0, sizeof(sets));
+    glob(pattern, 0, NULL, &sets);
+    results = calloc(sets.gl_pathc + (maxexp > 0 ? maxexp : 0) + 1,
+            sizeof(BenchResult));
+
+    for(i = 0; i < (int)sets.gl_pathc; i++) {
+        r = &(results[nresults++]);
+        r->corpus = strdup(sets.gl_pathv[i]);
+        fprintf(stderr, "%s\n", r->corpus);
+        if(bench_corpus(r, r->corpus, order, nthreads, names) < 0) {
+            free(r->corpus);
+            memset(r, 0, sizeof(BenchResult));
+            nresults--;
+        }
+    }
+
+    if(maxexp >= 3) {
+        fd = mkstemp(zipf);
+        if(fd < 0) {
+            fprintf(stderr, "Can't create a temporary file for the synthetic corpora\n");
+            maxexp = 0;
+        } else {
+            close(fd);
+        }
+    }
+    rng_seed(&rng, BENCH_SEED, 1);
+    for(i = 3; i <= maxexp; i++) {
+        nwords = (int)pow(10, i);
+        if(bench_zipf_corpus(zipf, nwords, &rng) < 0) break;
+        r = &(results[nresults++]);
+        snprintf(name, sizeof(name), "zipf:1e%d", i);
+        r->corpus = strdup(name);
+        fprintf(stderr, "%s\n", r->corpus);
+        if(bench_corpus(r, zipf, order, nthreads, names) < 0) {
+            free(r->corpus);
+            memset(r, 0, sizeof(BenchResult));
+            nresults--;
+            break;
+        }
+    }
+    if(fd >= 0) {
+        unlink(zipf);
+    }
+
+    if(outf) {
+        out = fopen(outf, "w");
+        if(!out) {
+            fprintf(stderr, "Error writing outfile: %s\n", outf);
+            out = stdout;
+        }
+    }
+    fprintf(out, "{\"order\": %d, \"threads\": %d, \"rng\": \"%s\", "
+            "\"results\": [\n", order, nthreads,
+            (kind == RNG_MT) ? "mt" : (kind == RNG_PHILOX) ? "philox" : "xoshiro");
+    for(i = 0; i < nresults; i++) {
+        bench_write(out, &(results[i]), i == nresults - 1);
+        free(results[i].corpus);
+    }
+    fprintf(out, "]}\n");
+    if(out != stdout) {
+        fclose(out);
+    }
+    free(results);
+    globfree(&sets);
+    return 0;
+}
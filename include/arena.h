@@ -0,0 +1,56 @@
+/*
+* Toolbox
+* Copyright (C) Zach Wilder 2022-2023
+* 
+* This file is a part of Toolbox
+*
+* Toolbox is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Toolbox is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Toolbox.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/*****
+ * Arena
+ *
+ * A region allocator. Memory is handed out from large blocks by bumping a
+ * pointer, is never freed piece by piece, and goes away all at once when the
+ * arena is destroyed.
+ *****/
+typedef struct ArenaBlock ArenaBlock;
+typedef struct Arena Arena;
+
+struct ArenaBlock {
+    ArenaBlock *next;       // Older blocks
+    size_t size;            // Bytes in data
+    size_t used;            // Bytes handed out
+    size_t pad;             // Keeps data 16 byte aligned
+    char data[];
+};
+
+struct Arena {
+    ArenaBlock *head;       // Block being allocated from
+    size_t blocksize;       // Size of new blocks
+};
+
+Arena* create_arena(size_t blocksize);
+void destroy_arena(Arena *a);
+void* arena_alloc(Arena *a, size_t n);
+char* arena_strdup(Arena *a, char *s);
+void arena_merge(Arena *to, Arena *from);
+size_t arena_size(Arena *a);
+
+#endif //ARENA_H
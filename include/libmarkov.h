@@ -0,0 +1,66 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LIBMARKOV_H
+#define LIBMARKOV_H
+
+#include <stddef.h>
+
+/*****
+ * libmarkov
+ *
+ * The generator as a library (make lib builds libmarkov.a and libmarkov.so).
+ * A model is trained or loaded once and is read only afterwards, so any
+ * number of threads can generate from it at the same time as long as each
+ * has its own MarkovRng. markov_generate_into writes into the caller's buffer
+ * and never allocates. Only the functions below are exported from
+ * libmarkov.so, everything else is built with hidden visibility.
+ *****/
+#if defined(__GNUC__)
+#define MARKOV_API __attribute__((visibility("default")))
+#else
+#define MARKOV_API
+#endif
+
+typedef struct MarkovModel MarkovModel; // A trained model
+typedef struct MarkovRng MarkovRng;     // Random number generator state
+
+// Models
+MARKOV_API MarkovModel* markov_train(char **files, int nfiles, int order,
+        int nthreads);
+MARKOV_API MarkovModel* markov_train_words(const char **words, int nwords,
+        int order);
+MARKOV_API MarkovModel* markov_load(const char *fname);
+MARKOV_API int markov_save(MarkovModel *m, const char *fname);
+MARKOV_API void markov_set_backoff(MarkovModel *m, int minobs);
+MARKOV_API void markov_free(MarkovModel *m);
+MARKOV_API char* markov_stats_json(MarkovModel *m);
+
+// Random number generators
+MARKOV_API MarkovRng* markov_rng_create(unsigned long seed,
+        unsigned long stream);
+MARKOV_API void markov_rng_free(MarkovRng *r);
+
+// Generation
+MARKOV_API int markov_generate_into(MarkovModel *m, MarkovRng *r, char *buf,
+        size_t cap);
+MARKOV_API int markov_generate_at(MarkovModel *m, unsigned long seed,
+        unsigned long k, char *buf, size_t cap);
+
+#endif //LIBMARKOV_H
@@ -26,11 +26,15 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 
 /*****
  * Toolbox
  *****/
 #include <mt19937.h>
+#include <rng.h>
+#include <arena.h>
 #include <slist.h>
 #include <clist.h>
 
@@ -43,84 +47,553 @@
  * Constants
  *****/
 enum {
-    KEYSZ    = 3,    // Size of key used in chain
-    CAPACITY = 10003 // Hash table size
+    KEYSZ    = 3,    // Default size of key used in chain (the chain order)
+    KEYMAX   = 8,    // Largest key size
+    BACKOFF  = 2,    // Back off from keys seen fewer times than this
+    NAMEMAX  = 100,  // Longest name generated, including the '\0'
+    CAPACITY = 1024, // Initial hash table size, grows as keys are added
+    MAXLOAD  = 4,    // Table grows past (MAXLOAD-1)/MAXLOAD slots used
+    ARENASZ  = 1 << 16, // Arena block size for word lists
+    DENSE_ALPHA = 27, // Dense engine alphabet, word end plus 'a' to 'z'
+    DENSE_MAXORDER = 4, // Largest order the dense engine is used for
+    UTF8_SYMS = 128, // Non-ASCII characters a table can hold (symbols 128 to 255)
+    UTF8_DIRECT = 0x800 // Codepoints below this find their symbol in one lookup
 };
 
 /*****
  * Structure definitions
  *****/
-typedef struct MHTNode MHTNode; // A node containing a string key and a list of chars
+typedef struct MFollower MFollower; // A character following a key, with its count
+typedef struct MFollower8 MFollower8; // A follower of a row quantized to 8 bits
+typedef struct MFollower16 MFollower16; // A follower of a row quantized to 16 bits
+typedef struct MHTNode MHTNode; // A node containing a string key and a row of followers
+typedef struct MStart MStart; // A key words start with, with its count
 typedef struct MHTable MHTable; // The hash table
-typedef struct MHTList MHTList; // List of MHTNodes (used for Overflow buckets)
+
+struct MFollower {
+    unsigned int count;     // Times ch followed the key
+    unsigned int prob;      // Alias method threshold, out of 2^32
+    unsigned char alias;    // Alias method fallback (index in the row)
+    char ch;                // Following character, '\0' ends the word
+};
+
+struct MFollower8 {
+    unsigned char prob;     // Alias method threshold, out of 2^8
+    unsigned char alias;
+    char ch;
+};
+
+struct MFollower16 {
+    uint16_t prob;          // Alias method threshold, out of 2^16
+    unsigned char alias;
+    char ch;
+};
 
 struct MHTNode {
-    char *key;              // Key
-    CList *values;          // List of characters
-    int nvalues;            // Number of characters in CList
+    char key[KEYMAX + 1];   // Key, stored in the slot (empty slot if "")
+    unsigned int hash;      // Hash of the key, saves most strcmp calls
+    int first;              // Index of the first follower in MHTable follows
+    int nnexts;             // Number of distinct followers
+    int cap;                // Follower slots reserved for this node
+    int nvalues;            // Total occurrences of all followers
+    int starts;             // Words that start with this key
+};
+
+struct MStart {
+    int slot;               // Slot of the key
+    unsigned int count;     // Words that start with it
+    unsigned int prob;      // Alias method threshold, out of 2^32
+    int alias;              // Alias method fallback (index in starts)
 };
 
 struct MHTable {
-    MHTNode **items;         // Items in table
-    MHTList **ofbuckets;     // Overflow buckets
-    int size;               // Hash table size
+    MHTNode *items;         // Slots, open addressing with linear probing
+    int size;               // Hash table size (power of two)
     int count;              // Items in hash table
-    SList *keys;            // List of keys for random access
+    int order;              // Longest key, keys 1 to order long are stored
+    int minobs;             // Back off from keys seen fewer times than this
     int wmax;               // Longest word that should be generated
-    int wmin;               // Shortest word that should be generated
-    SList *stkeys;          // List of keys at the beginning of words
-};
-
-struct MHTList {
-    MHTNode *data;
-    MHTList *next;
+    int wmin;               // Shortest word that should be generated (0 if none)
+    unsigned int lens[NAMEMAX]; // Words of each length, the last counts longer ones too
+    MStart *starts;         // Keys words start with, in slot order, once finalized
+    int nstarts;            // Number of distinct starting keys
+    MFollower *follows;     // Follower rows of every node, NULL if quantized
+    void *qfollows;         // Quantized rows in their place, or NULL
+    int qbits;              // Bits rows are quantized to when finalized, 8, 16 or 0
+    int nfollows;           // Follower slots in use
+    int fcap;               // Follower slots allocated
+    int *dense;             // Slot of each packed key, NULL if it doesn't fit
+    int drows;              // Packed keys in dense, DENSE_ALPHA^order
+    unsigned int syms[UTF8_SYMS]; // Codepoint of each symbol from 128 on
+    int nsyms;              // Symbols in use, 0 for an ASCII table
+    unsigned char symof[UTF8_DIRECT]; // Symbol of each codepoint, 0 if none
+    Arena *arena;           // Holds the arrays once finalized, or NULL
+    void *map;              // Mapped model file the arrays point into, or NULL
+    size_t mapsize;         // Size of the mapping
 };
 
 /*****
  * markov_structures.c
  *****/
 // Structure creation
-MHTNode* create_mhtnode(char *key, CList *values);
-MHTable* create_mhtable(int size);
-MHTList** create_mht_ofbuckets(MHTable *table);
-MHTList* create_mhtlist(MHTNode *item);
+MHTable* create_mhtable(int size, int order);
 
 // Structure destruction
-void destroy_mhtnode(MHTNode *item);
 void destroy_mhtable(MHTable *table);
-void destroy_mht_ofbuckets(MHTable *table);
-void destroy_mhtlist(MHTList *headref);
 
 // MHTable functions
 unsigned long mht_hash(char *str);
-void mht_collision(MHTable *table, unsigned long index, MHTNode *item); 
-void mht_insert(MHTable *table, char *key, CList *values);
-CList* mht_search(MHTable *table, char *key);
+void mht_resize(MHTable *ht, int size);
+MHTNode* mht_insert_node(MHTable *table, char *key);
+void mht_insert(MHTable *table, char *key, char c);
+void mht_merge(MHTable *to, MHTable *from);
 MHTNode* mht_search_node(MHTable *ht, char *key);
+MHTable* mht_clone(MHTable *ht);
 void mht_delete(MHTable *table, char *key);
 void mht_print(MHTable *table);
 void mht_write(MHTable *ht, char *fname, char *mode);
+void mht_write_file(MHTable *ht, FILE *f);
 void mht_print_item(MHTable *table, char *key);
+void mht_finalize(MHTable *ht); // Finalized tables are read only...
+void mht_thaw(MHTable *ht);     // ...until thawed
+
+// MHTNode functions
+void mhtnode_add(MHTable *ht, MHTNode *node, char c, unsigned int count);
+void mhtnode_build_alias(MHTable *ht, MHTNode *node);
+void mht_build_start_alias(MHTable *ht);
+char mhtnode_get_random(MHTable *ht, MHTNode *node, Rng *rng);
+void mhtnode_bracketwrite(MHTable *ht, MHTNode *node, FILE *f);
+
+/*****
+ * markov_prune.c
+ *
+ * Smaller models: mht_prune drops rare transitions, mht_quantize keeps only
+ * the alias tables of the rows, their thresholds cut to 8 or 16 bits.
+ *****/
+typedef struct MDrift MDrift; // How far a pruned or quantized model moved
+
+struct MDrift {
+    double weight;          // Transitions the comparison is weighted by
+    double tv;              // Mean total variation of the next character
+    double kl;              // Mean KL divergence, bits, of each row from the
+                            // old one renormalized to what is left
+    double dropped;         // Mean probability of transitions gone
+    double backoff;         // Share of contexts that are gone (backed off)
+};
+
+static inline int mht_follow_size(MHTable *ht) {
+    // Bytes of one follower, in the format the rows are in
+    if(!ht->qfollows) return sizeof(MFollower);
+    return (ht->qbits == 8) ? sizeof(MFollower8) : sizeof(MFollower16);
+}
 
-// MHTList functions
-MHTList* mhtlist_insert(MHTList *headref, MHTNode *item);
-MHTNode* mhtlist_pop(MHTList **headref);
+static inline char mht_follow_ch(MHTable *ht, int i) {
+    // Character of follower i of the pool, whatever the format
+    if(!ht->qfollows) return ht->follows[i].ch;
+    if(ht->qbits == 8) return ((MFollower8*)ht->qfollows)[i].ch;
+    return ((MFollower16*)ht->qfollows)[i].ch;
+}
+
+void mhtnode_probs(MHTable *ht, MHTNode *node, double *p);
+int mht_prune(MHTable *ht, unsigned int mincount);
+void mht_quantize(MHTable *ht, int bits);
+void mht_dequantize_rows(MHTable *ht, MFollower *follows);
+void mht_quantize_rows(MHTable *ht, void *out);
+void mht_drift(MHTable *from, MHTable *to, MDrift *d);
+
+/*****
+ * markov_dense.c
+ *
+ * When every key and follower is a lowercase letter (or the word end), a key
+ * packs into a base DENSE_ALPHA number below DENSE_ALPHA^order and ht->dense
+ * maps it straight to its slot, skipping the hash and strcmp. Letters are 1 to
+ * 26, so shorter keys pack to different numbers (leading zeros). The alphabet
+ * is a constant, so the arithmetic below folds down at compile time.
+ *****/
+static inline int dense_sym(char c) {
+    // '\0' is 0, 'a' to 'z' are 1 to 26, anything else doesn't fit
+    if(!c) return 0;
+    if((c >= 'a') && (c <= 'z')) return c - 'a' + 1;
+    return -1;
+}
+
+static inline int dense_index(char *key, int order) {
+    // Pack a key of 1 to order letters, -1 if it can't be packed
+    int i = 0;
+    int j = 0;
+    int s = 0;
+    for(j = 0; key[j]; j++) {
+        s = dense_sym(key[j]);
+        if((s <= 0) || (j == order)) return -1;
+        i = i * DENSE_ALPHA + s;
+    }
+    return j ? i : -1;
+}
+
+static inline int dense_next(int i, char c, int rows) {
+    // Packed key of the last (up to order) characters of key i followed by c
+    return (i % (rows / DENSE_ALPHA)) * DENSE_ALPHA + dense_sym(c);
+}
+
+void mht_create_dense(MHTable *ht);
+void mht_drop_dense(MHTable *ht);
+void mht_rebuild_dense(MHTable *ht);
+MHTNode* mht_dense_node(MHTable *ht, int i);
+
+/*****
+ * markov_utf8.c
+ *
+ * Keys and followers are symbols, one byte per character: ASCII as itself,
+ * other characters numbered from 128 in ht->syms. See the file.
+ *****/
+unsigned int utf8_lower(unsigned int cp);
+unsigned int utf8_upper(unsigned int cp);
+int utf8_decode(const char *s, unsigned int *cp);
+int utf8_encode(unsigned int cp, char *out);
+void utf8_change_case(char *s, int len, bool upper, int from);
+int mht_symbol(MHTable *ht, unsigned int cp, bool add);
+void mht_index_symbols(MHTable *ht);
+bool mht_sort_symbols(MHTable *ht, unsigned char *map);
+void mht_map_symbols(char *key, unsigned char *map);
+int markov_encode_word(MHTable *ht, char *word, bool add);
+int markov_decode_name(MHTable *ht, const char *syms, int n, char *out,
+        int cap, bool capital);
+
+/*****
+ * markov_file.c
+ *
+ * A model file is an MKVHeader followed by the slot, follower, start and dense
+ * arrays exactly as they sit in a finalized MHTable, then the word lengths and
+ * the codepoint of each symbol. Nothing in them is a
+ * pointer, so mht_load maps the file and points the table at it.
+ *****/
+enum {
+    MKV_VERSION = 5,         // Bumped whenever the layout changes
+    MKV_ENDIAN  = 0x01020304, // Written natively, read back to check byte order
+    MKV_ALIGN   = 64         // Every array starts on a cache line
+};
+
+typedef struct MKVHeader MKVHeader;
+struct MKVHeader {
+    char magic[4];           // "MKV" and a zero
+    uint32_t version;        // MKV_VERSION
+    uint32_t endian;         // MKV_ENDIAN
+    uint32_t hdrsize;        // sizeof(MKVHeader)
+    int32_t order;
+    int32_t minobs;
+    int32_t wmin;
+    int32_t wmax;
+    int32_t size;            // Slots
+    int32_t count;           // Keys
+    int32_t nfollows;        // Followers
+    int32_t nstarts;         // Starts
+    int32_t drows;           // Dense rows, 0 if the model isn't dense
+    int32_t nsyms;           // Non-ASCII symbols
+    int32_t qbits;           // Bits followers are quantized to, 0 for MFollower
+    int32_t pad;
+    uint64_t items;          // File offset of each array
+    uint64_t follows;
+    uint64_t starts;
+    uint64_t dense;
+    uint64_t lens;
+    uint64_t syms;
+    uint64_t filesize;       // Size of the whole file
+    uint64_t checksum;       // FNV-1a of everything after the header
+};
+
+int mht_save(MHTable *ht, char *fname);
+MHTable* mht_load(char *fname);
+
+/*****
+ * markov_corpus.c
+ *****/
+typedef struct MCorpus MCorpus; // The text of a corpus file
+
+struct MCorpus {
+    char *data;             // File contents, not '\0' terminated
+    size_t len;             // Bytes in data
+    bool mapped;            // data is a mapping rather than malloc'd
+};
+
+int markov_corpus_open(MCorpus *c, char *fname);
+void markov_corpus_close(MCorpus *c);
+MHTable* markov_train_files(char **files, int nfiles, int order, int nthreads);
+
+/*****
+ * markov_sink.c
+ *
+ * Output is copied into one of two large buffers. When a buffer fills, a
+ * writer thread writes it out while the other buffer is filled, so generation
+ * only waits on the disk if it gets a whole buffer ahead of it.
+ *****/
+enum {
+    MSINKSZ = 1 << 20        // Bytes in each sink buffer
+};
+
+typedef struct MSink MSink; // Double buffered output, written by its own thread
+
+struct MSink {
+    int fd;                 // Where the output goes
+    bool owned;             // Close fd along with the sink
+    char *buf[2];           // The two buffers
+    size_t len[2];          // Bytes in each buffer
+    int cur;                // Buffer being filled
+    int pending;            // Buffer handed to the writer, -1 if none
+    bool closing;           // No more buffers are coming
+    bool error;             // A write failed
+    pthread_t writer;
+    pthread_mutex_t lock;   // Guards pending, closing and the handover
+    pthread_cond_t ready;   // Signalled when pending or closing changes
+};
+
+MSink* msink_create(int fd, bool owned);
+MSink* msink_open(char *fname, bool append);
+void msink_write(MSink *s, const char *data, size_t n);
+void msink_puts(MSink *s, const char *str, char sep);
+int msink_close(MSink *s);
+
+/*****
+ * markov_uniq.c
+ *
+ * The set of names already generated, for --unique. Names are spread over
+ * UNIQSTRIPES stripes by hash, each with its own lock.
+ *****/
+enum {
+    UNIQSTRIPES = 64,        // Stripes in the set (a power of two)
+    UNIQTRIES   = 1000       // Repeats in a row before the model is saturated
+};
+
+typedef struct MUniqItem MUniqItem;
+typedef struct MUniqStripe MUniqStripe;
+typedef struct MUniq MUniq; // Concurrent set of strings
+
+struct MUniqItem {
+    unsigned long hash;
+    char *str;              // NULL if the slot is empty
+};
+
+struct MUniqStripe {
+    pthread_mutex_t lock;
+    MUniqItem *items;       // Open addressing with linear probing
+    int size;               // Slots (power of two)
+    int count;              // Names in the stripe
+    Arena *arena;           // Holds the names
+};
+
+struct MUniq {
+    MUniqStripe stripes[UNIQSTRIPES];
+    long retries;           // Repeats thrown away by markov_generate_batch
+    bool saturated;         // A block gave up after UNIQTRIES repeats in a row (set atomically)
+};
+
+MUniq* create_muniq(int expected);
+void destroy_muniq(MUniq *u);
+bool muniq_insert(MUniq *u, char *s);
+
+/*****
+ * markov_serve.c
+ *****/
+enum {
+    SERVE_LINEMAX = 256,     // Longest request line
+    SERVE_MAXN    = 1000000, // Most names in one answer
+    SERVE_OUTSZ   = 1 << 16, // Answers are sent in pieces of about this size
+    SERVE_EVENTS  = 64,      // Events taken from epoll at a time
+    SERVE_SNDTIMEO = 5       // Seconds a client may hold up a send
+};
+
+typedef struct MServeModel MServeModel; // A model clients can ask for
+
+struct MServeModel {
+    char *name;             // Name used in requests
+    MHTable *ht;
+};
+
+int markov_serve(char *path, MServeModel *models, int nmodels, int nthreads);
 
 /*****
  * markov_gen.c
  *****/
 // Markov chain generator functions
-MHTable* markov_generate_mht(SList *words);
-CList* markov_find_match(char *key, SList *words);
+MHTable* markov_generate_mht(SList *words, int order, int nthreads);
+int markov_count_word(MHTable *ht, char *word);
+int markov_add_words(MHTable *ht, SList *words);
+int markov_remove_words(MHTable *ht, SList *words);
+MHTNode* markov_backoff_node(MHTable *ht, char *name, int n, int d);
 void string_to_lower(char *str);
 void slist_to_lower(SList *words);
 void string_to_upper(char *str);
 void slist_to_upper(SList *words);
-char markov_find_key_str(char *str, char *key);
 
 // Random name functions
-MHTNode* mht_get_random_node(MHTable *ht);
-char clist_get_random(CList *cl, int n);
-SList* generate_random_word(MHTable *ht,char *outf);
+MHTNode* mht_get_random_node(MHTable *ht, Rng *rng);
+int markov_generate_name(MHTable *ht, Rng *rng, char *name, int cap);
+SList* generate_random_word(MHTable *ht, Rng *rng, MSink *out);
+
+/*****
+ * markov_metrics.c
+ *
+ * Latency histograms and counters, kept per thread and only recorded while
+ * markov_metrics_on is set (markov --metrics).
+ *****/
+enum {
+    HIST_SUBBITS = 5,        // Sub-buckets per power of two, as bits
+    HIST_SUB     = 1 << HIST_SUBBITS,
+    HIST_BUCKETS = (64 - HIST_SUBBITS + 1) * HIST_SUB,
+    MET_SAMPLE   = 16        // Batches time one name in this many (counters are exact)
+};
+
+typedef enum {
+    MET_TRAIN = 0,           // One thread's share of a corpus file
+    MET_GEN,                 // One name in a batch (sampled, see MET_SAMPLE)
+    MET_WRITE,               // One sink buffer written out
+    MET_REQUEST,             // One --serve request
+    MET_NHISTS
+} MetHist;
+
+typedef struct MHist MHist;
+typedef struct MMetrics MMetrics;
+
+struct MHist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct MMetrics {
+    MHist hists[MET_NHISTS];    // Nanoseconds
+    uint64_t names;         // Names generated
+    uint64_t steps;         // Characters drawn along the chain
+    uint64_t deadends;      // Names cut short by a context with no row
+    uint64_t retries;       // Names drawn again (--unique)
+    uint64_t bytes;         // Bytes written by sinks
+    MMetrics *next;         // Next running thread
+};
+
+extern bool markov_metrics_on;
+
+int mmetrics_enable(char *fname);
+void mmetrics_dump(void);
+uint64_t mmetrics_now(void);
+MMetrics* mmetrics_self(void);
+void mmetrics_record(MetHist h, uint64_t start);
+void mmetrics_name(int steps, bool deadend);
+void mmetrics_count(uint64_t *counter, uint64_t n);
+
+/*****
+ * markov_stats.c
+ *****/
+enum {
+    STATS_PROBES    = 16,    // Probe histogram buckets, the last counts farther too
+    STATS_TOPSTARTS = 10     // Most common starts listed
+};
+
+typedef struct MStats MStats; // Measurements of a table, see mht_stats
+
+struct MStats {
+    int keys;               // Contexts
+    int slots;
+    double load;            // keys / slots
+    int contexts[KEYMAX + 1]; // Contexts of each key length
+    double branching[KEYMAX + 1]; // Mean distinct followers, by key length
+    double entropy[KEYMAX + 1]; // Bits per character drawn, by key length
+    double meanbranch;
+    int maxbranch;
+    double meanentropy;     // Weighted by how often each context is seen
+    double maxentropy;
+    int probes[STATS_PROBES]; // Keys by distance from their home slot
+    double meanprobe;
+    int maxprobe;
+    int empty;              // Contexts with nothing left (after removals)
+    int endonly;            // Contexts that always end the word
+    int sparse;             // Contexts generation backs off from (< minobs)
+    int nstarts;
+    long startwords;        // Words counted over all starts
+    double startentropy;    // Bits per start drawn
+    int topstarts[STATS_TOPSTARTS]; // Index in starts, most common first, -1 past the end
+    size_t slotbytes;       // Bytes of each array
+    size_t followbytes;
+    size_t startbytes;
+    size_t densebytes;
+    size_t heldbytes;       // Everything the table holds (arena block or mapping)
+};
+
+void mht_stats(MHTable *ht, MStats *st);
+void mht_write_stats(MHTable *ht, FILE *f);
+
+/*****
+ * markov_constrain.c
+ *
+ * Names drawn so that every one meets the constraints, see the file.
+ *****/
+enum {
+    CONSTRAIN_STATES = 1 << 22, // Most chain states a model may have
+    CONSTRAIN_CELLS = 1 << 25   // Most success probabilities kept (8 bytes each)
+};
+
+typedef struct MConstraint MConstraint;   // What the names must look like
+typedef struct MConstrained MConstrained; // Tables for drawing such names
+
+struct MConstraint {
+    int minlen;             // Shortest name, 0 for no limit
+    int maxlen;             // Longest name, 0 for the model's longest word
+    char *prefix;           // Names start with this, or NULL
+    char *suffix;           // Names end with this, or NULL
+    char **forbid;          // Names never contain any of these
+    int nforbid;
+};
+
+MConstrained* markov_constrain(MHTable *ht, MConstraint *c);
+void destroy_mconstrained(MConstrained *mc);
+int markov_generate_constrained(MConstrained *mc, Rng *rng, char *name,
+        int cap);
+
+/*****
+ * markov_template.c
+ *
+ * Names of several parts, "{genre} {species:lower}", one model per slot.
+ *****/
+enum {
+    TEMPLATEMAX = 1024       // Longest filled template, with the '\0'
+};
+
+typedef enum {
+    TPL_ASIS = 0,           // As generated (capitalized)
+    TPL_LOWER,
+    TPL_UPPER,
+    TPL_TITLE,
+    TPL_NMODS
+} TplMod;
+
+typedef struct MTemplate MTemplate;
+
+MTemplate* markov_template_parse(char *spec);
+int markov_template_bind(MTemplate *t, char *binding);
+int markov_template_load(MTemplate *t, char *datadir, int order, int minobs);
+int markov_template_generate(MTemplate *t, Rng *rng, char *out, int cap);
+int markov_template_batch(MTemplate *t, int n, unsigned long seed,
+        unsigned long offset, MSink *out, char sep);
+MHTable* markov_template_model(MTemplate *t, int i, char **name);
+void destroy_mtemplate(MTemplate *t);
+
+/*****
+ * markov_batch.c
+ *
+ * Large batches are cut into blocks of BATCHSZ names. Block b always uses rng
+ * stream b of the seed, so the output is the same whatever the thread count
+ * (except with a MUniq set, which threads race to fill). With the Philox rng,
+ * name k of a seed instead uses stream k on its own (see markov_generate_nth),
+ * so any slice of the names can be made without the names before it.
+ *****/
+enum {
+    BATCHSZ = 16384          // Names per block
+};
+
+int markov_generate_batch(MHTable *ht, int n, int nthreads,
+        unsigned long seed, unsigned long offset, MSink *out, char sep,
+        MUniq *uniq, MConstrained *mc);
+int markov_generate_nth(MHTable *ht, MConstrained *mc, unsigned long seed,
+        unsigned long k, char *name, int cap);
 
 #endif //MARKOV_H
@@ -48,6 +48,17 @@
 #include <limits.h>
 #include <time.h>
 
+#define MT_N 624
+
+/* Generator state, one per thread when used with the _r functions */
+typedef struct MTState {
+    unsigned long mt[MT_N];
+    int mti;
+} MTState;
+
+void init_genrand_r(MTState *st, unsigned long s);
+void init_by_array_r(MTState *st, unsigned long init_key[], int key_length);
+unsigned long genrand_int32_r(MTState *st);
 
 void init_genrand(unsigned long s);
 void init_by_array(unsigned long init_key[], int key_length);
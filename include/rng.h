@@ -0,0 +1,80 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+#include <mt19937.h>
+
+/*****
+ * Random number generator handed to the generation functions. Each thread
+ * owns one, so nothing random is shared between threads.
+ *
+ * Three backends: MT19937, kept so old seeds give the same names, four
+ * interleaved xoshiro128++ generators, whose update is a handful of adds,
+ * shifts and rotates the compiler can do for all four lanes at once, and
+ * Philox4x32-10, which has no running state at all: its numbers are a hash of
+ * (seed, stream, counter), so stream k can be started without going through
+ * streams 0 to k-1. Numbers are made into a buffer that rng_u32 reads,
+ * RNGBLOCK at a time (four at a time for Philox, whose streams are short).
+ *****/
+typedef struct Rng Rng;
+
+typedef enum {
+    RNG_XOSHIRO = 0,        // xoshiro128++ x4, the default
+    RNG_MT,                 // MT19937
+    RNG_PHILOX              // Philox4x32-10, counter based
+} RngKind;
+
+enum {
+    RNG_LANES = 4,          // Interleaved xoshiro generators
+    RNGBLOCK  = 64          // Numbers made per refill, a multiple of RNG_LANES
+};
+
+struct Rng {
+    RngKind kind;
+    union {
+        MTState mt;         // MT19937 state
+        uint32_t xo[4][RNG_LANES]; // xoshiro128++ states, word major
+        struct {
+            uint32_t key[2];    // The seed
+            uint32_t ctr[4];    // Block number, 0, and the stream
+        } ph;               // Philox key and counter
+    } st;
+    uint32_t buf[RNGBLOCK]; // Numbers not handed out yet
+    int pos;                // Next number in buf
+};
+
+void rng_set_default(RngKind kind);
+RngKind rng_get_default(void);
+int rng_kind_from_name(char *name, RngKind *kind);
+void rng_seed(Rng *r, unsigned long seed, unsigned long stream);
+void rng_seed_kind(Rng *r, RngKind kind, unsigned long seed,
+        unsigned long stream);
+void rng_refill(Rng *r);
+int rng_below(Rng *r, int n);
+
+static inline uint32_t rng_u32(Rng *r) {
+    if(r->pos == RNGBLOCK) rng_refill(r);
+    return r->buf[r->pos++];
+}
+
+#endif //RNG_H
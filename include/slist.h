@@ -24,6 +24,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <arena.h>
 
 struct SList {
     char *data;
@@ -37,6 +38,7 @@ typedef struct SList SList;
  *******************/
 SList* create_slist(char *s);
 SList* create_slist_blank(int strsize);
+SList* create_slist_arena(Arena *a, char *s);
 void destroy_slist(SList **head);
 
 void slist_push_blank(SList **head, int strsize);
@@ -53,6 +55,7 @@ bool slist_delete(SList **s, char *str);
 int slist_get_max(SList *s);
 int slist_get_min(SList *s);
 SList* slist_load_dataset(char *fname);
+SList* slist_load_dataset_arena(char *fname, Arena *a);
 void slist_write(SList *s, char d, char *fname, char *mode);
 
 #endif
@@ -0,0 +1,100 @@
+/*
+* Toolbox
+* Copyright (C) Zach Wilder 2022-2023
+* 
+* This file is a part of Toolbox
+*
+* Toolbox is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Toolbox is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Toolbox.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <arena.h>
+
+enum {
+    ARENA_ALIGN = 16 // Every allocation starts on this boundary
+};
+
+Arena* create_arena(size_t blocksize) {
+    Arena *a = malloc(sizeof(Arena));
+    a->head = NULL;
+    a->blocksize = blocksize;
+    return a;
+}
+
+void destroy_arena(Arena *a) {
+    /* Free every block, and everything allocated from them with it */
+    ArenaBlock *tmp = NULL;
+    if(!a) return;
+    while(a->head) {
+        tmp = a->head;
+        a->head = a->head->next;
+        free(tmp);
+    }
+    free(a);
+}
+
+void* arena_alloc(Arena *a, size_t n) {
+    /* Hand out n bytes. A new block is started when the current one is full;
+     * allocations bigger than a block get a block of their own. */
+    ArenaBlock *b = a->head;
+    size_t size = 0;
+    void *result = NULL;
+
+    n = (n + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+    if(!b || (b->used + n > b->size)) {
+        size = (n > a->blocksize) ? n : a->blocksize;
+        b = malloc(sizeof(ArenaBlock) + size);
+        b->size = size;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+    result = b->data + b->used;
+    b->used += n;
+    return result;
+}
+
+char* arena_strdup(Arena *a, char *s) {
+    size_t n = strlen(s) + 1;
+    char *result = arena_alloc(a, n);
+    memcpy(result, s, n);
+    return result;
+}
+
+void arena_merge(Arena *to, Arena *from) {
+    /* Move every block of from into to, so memory allocated from either lives
+     * until to is destroyed. from is left empty. */
+    ArenaBlock *tail = from->head;
+    if(!tail) return;
+    while(tail->next) {
+        tail = tail->next;
+    }
+    if(to->head) {
+        // Keep allocating from to's current block
+        tail->next = to->head->next;
+        to->head->next = from->head;
+    } else {
+        to->head = from->head;
+    }
+    from->head = NULL;
+}
+
+size_t arena_size(Arena *a) {
+    // Bytes reserved by the arena
+    ArenaBlock *b = NULL;
+    size_t result = 0;
+    for(b = a->head; b; b = b->next) {
+        result += sizeof(ArenaBlock) + b->size;
+    }
+    return result;
+}
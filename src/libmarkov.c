@@ -0,0 +1,138 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <libmarkov.h>
+
+/*****
+ * Library handles, thin wrappers around MHTable and Rng
+ *****/
+struct MarkovModel {
+    MHTable *ht;            // Finalized table
+};
+
+struct MarkovRng {
+    Rng rng;
+};
+
+static MarkovModel* markov_wrap(MHTable *ht) {
+    MarkovModel *m = NULL;
+    if(!ht) return NULL;
+    m = malloc(sizeof(MarkovModel));
+    m->ht = ht;
+    return m;
+}
+
+MarkovModel* markov_train(char **files, int nfiles, int order, int nthreads) {
+    /* Train a model of the given order (1 to KEYMAX) from corpus files of
+     * whitespace separated words. NULL if the order is out of range or no
+     * file could be read. */
+    if((order < 1) || (order > KEYMAX)) return NULL;
+    return markov_wrap(markov_train_files(files, nfiles, order, nthreads));
+}
+
+MarkovModel* markov_train_words(const char **words, int nwords, int order) {
+    /* Train a model from an array of words. The words are not modified or
+     * kept. NULL if the order is out of range. */
+    MHTable *ht = NULL;
+    char *word = NULL;
+    int cap = 0;
+    int len = 0;
+    int i = 0;
+
+    if((order < 1) || (order > KEYMAX)) return NULL;
+    ht = create_mhtable(CAPACITY, order);
+    for(i = 0; i < nwords; i++) {
+        len = strlen(words[i]);
+        if(len + 1 > cap) {
+            cap = len + 1;
+            word = realloc(word, cap);
+        }
+        memcpy(word, words[i], len + 1);
+        markov_count_word(ht, word);
+    }
+    free(word);
+    mht_finalize(ht);
+    return markov_wrap(ht);
+}
+
+MarkovModel* markov_load(const char *fname) {
+    // Map a model file written by markov_save (or markov --save)
+    return markov_wrap(mht_load((char*)fname));
+}
+
+int markov_save(MarkovModel *m, const char *fname) {
+    // Returns 0 on success, -1 if the file couldn't be written
+    return mht_save(m->ht, (char*)fname);
+}
+
+void markov_set_backoff(MarkovModel *m, int minobs) {
+    // Back off from keys seen fewer than minobs times while generating
+    m->ht->minobs = minobs;
+}
+
+void markov_free(MarkovModel *m) {
+    if(!m) return;
+    destroy_mhtable(m->ht);
+    free(m);
+}
+
+char* markov_stats_json(MarkovModel *m) {
+    /* The model's statistics (see mht_stats) as a JSON object, in a string
+     * the caller frees. NULL if it couldn't be made. */
+    char *json = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&json, &len);
+    if(!f) return NULL;
+    mht_write_stats(m->ht, f);
+    fclose(f);
+    return json;
+}
+
+MarkovRng* markov_rng_create(unsigned long seed, unsigned long stream) {
+    /* Different streams of one seed are independent, so threads can share a
+     * seed and use their thread number as the stream. */
+    MarkovRng *r = malloc(sizeof(MarkovRng));
+    rng_seed(&r->rng, seed, stream);
+    return r;
+}
+
+void markov_rng_free(MarkovRng *r) {
+    free(r);
+}
+
+int markov_generate_into(MarkovModel *m, MarkovRng *r, char *buf, size_t cap) {
+    /* Generate one name into buf, truncated to fit cap bytes including the
+     * '\0'. Returns the length of the name, or -1 if cap is 0 or the model
+     * has no key to start a name with. */
+    if(!cap || !m->ht->nstarts) return -1;
+    if(cap > NAMEMAX) cap = NAMEMAX;
+    return markov_generate_name(m->ht, &r->rng, buf, (int)cap);
+}
+
+int markov_generate_at(MarkovModel *m, unsigned long seed, unsigned long k,
+        char *buf, size_t cap) {
+    /* Name k of seed, made on its own and the same every time, on any
+     * machine: the name "markov --seed seed --offset k -n 1" prints. Needs no
+     * MarkovRng. Returns its length, or -1 if cap is 0 or the model has no
+     * key to start a name with. */
+    if(!cap || !m->ht->nstarts) return -1;
+    if(cap > NAMEMAX) cap = NAMEMAX;
+    return markov_generate_nth(m->ht, NULL, seed, k, buf, (int)cap);
+}
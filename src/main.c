@@ -18,20 +18,214 @@
 * along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <markov.h>
+#include <getopt.h>
+
+static char* model_name(char *path) {
+    // Name a served model after its file: "data/fnames.txt" is "fnames"
+    char *slash = strrchr(path, '/');
+    char *name = strdup(slash ? slash + 1 : path);
+    char *dot = strrchr(name, '.');
+    if(dot && (dot != name)) *dot = '\0';
+    return name;
+}
+
+static int serve(char *path, char **modelfs, int nmodelfs, char **files,
+        int nfiles, int order, int minobs, int nthreads) {
+    /* Load every model file and train a model on each corpus file, then
+     * serve them all until interrupted */
+    MServeModel *models = calloc(nmodelfs + nfiles + 1, sizeof(MServeModel));
+    MHTable *ht = NULL;
+    int n = 0;
+    int i = 0;
+    int result = -1;
+
+    for(i = 0; i < nmodelfs + nfiles; i++) {
+        if(i < nmodelfs) {
+            ht = mht_load(modelfs[i]);
+        } else {
+            ht = markov_train_files(files + i - nmodelfs, 1, order, nthreads);
+        }
+        if(!ht) continue;
+        if(minobs) ht->minobs = minobs;
+        models[n].ht = ht;
+        models[n].name = model_name((i < nmodelfs) ? modelfs[i] : files[i - nmodelfs]);
+        n++;
+    }
+    if(n) {
+        result = markov_serve(path, models, n, nthreads);
+    } else {
+        fprintf(stderr, "No models to serve\n");
+    }
+    for(i = 0; i < n; i++) {
+        destroy_mhtable(models[i].ht);
+        free(models[i].name);
+    }
+    free(models);
+    return result;
+}
+
+static int templates(char *spec, char **binds, int nbinds, int n,
+        char *outf, int order, int minobs, unsigned long seed,
+        unsigned long offset) {
+    /* Build the models a template names (data/<name>.txt unless bound to a
+     * file) and write n filled templates, one per line */
+    MTemplate *t = markov_template_parse(spec);
+    MSink *out = NULL;
+    int result = -1;
+    int i = 0;
+
+    for(i = 0; t && (i < nbinds); i++) {
+        if(markov_template_bind(t, binds[i]) < 0) {
+            fprintf(stderr, "No slot for --bind %s\n", binds[i]);
+        }
+    }
+    if(!t || (markov_template_load(t, "data", order, minobs) < 0)) {
+        destroy_mtemplate(t);
+        return -1;
+    }
+    if(outf) {
+        out = msink_open(outf, true);
+        if(!out) {
+            fprintf(stderr, "Error writing outfile: %s\n", outf);
+        }
+    }
+    if(!out) {
+        fflush(stdout);
+        out = msink_create(STDOUT_FILENO, false);
+    }
+    if(out) {
+        i = markov_template_batch(t, n, seed, offset, out, '\n');
+        result = msink_close(out);
+        if(outf && (result == 0)) {
+            printf("%d names written to %s\n", i, outf);
+        }
+    }
+    destroy_mtemplate(t);
+    return result;
+}
+
+static size_t model_bytes(MHTable *ht) {
+    // Bytes of the arrays a model is made of
+    MStats st;
+    mht_stats(ht, &st);
+    return st.slotbytes + st.followbytes + st.startbytes + st.densebytes;
+}
+
+static int compact(MHTable *ht, int prune, int qbits) {
+    /* --prune and --quantize, then what they saved and how far they moved
+     * the model, measured against a copy of it from before. -1 if the model
+     * can't be pruned that far. */
+    MHTable *orig = NULL;
+    MDrift d;
+    size_t before = 0;
+    size_t after = 0;
+    int dropped = 0;
+
+    if(!ht->arena && !ht->map) {
+        // Compact what --add and --remove left
+        mht_finalize(ht);
+    }
+    orig = mht_clone(ht);
+    before = model_bytes(orig);
+    if(prune > 1) {
+        dropped = mht_prune(ht, prune);
+        if(dropped < 0) {
+            fprintf(stderr, "Pruning transitions seen fewer than %d times "
+                    "would leave no key to start a name with\n", prune);
+            destroy_mhtable(orig);
+            return -1;
+        }
+        printf("Pruned %d of %d transitions and %d of %d contexts seen fewer "
+                "than %d times\n", dropped, orig->nfollows,
+                orig->count - ht->count, orig->count, prune);
+    }
+    if(qbits) {
+        mht_quantize(ht, qbits);
+        printf("Quantized transitions to %d bits\n", qbits);
+    }
+    after = model_bytes(ht);
+    mht_drift(orig, ht, &d);
+    printf("Model %zu bytes, was %zu (%.1f%% saved)\n", after, before,
+            before ? 100.0 * (before - (double)after) / before : 0.0);
+    printf("Next character distributions moved %.4f (total variation), "
+            "%.4f bits (KL divergence over what is kept); %.2f%% of the "
+            "probability went to dropped transitions, %.2f%% of contexts now "
+            "back off\n",
+            d.tv, d.kl, 100 * d.dropped, 100 * d.backoff);
+    destroy_mhtable(orig);
+    return 0;
+}
 
 int main(int argc, char **argv) {
-    init_genrand(time(NULL));
     MHTable *ht = NULL;
     int i = 0;
     int n = 10;
+    int nthreads = 1;
     int c = 0;
+    int order = KEYSZ;
+    int minobs = 0;
+    bool gen = true;
+    bool setn = false;
     SList *words = NULL;
     SList *tmp = NULL;
+    Arena *corpus = NULL; // Holds the words read for the log, --add and --remove
+    SList *addw = NULL;
+    SList *remw = NULL;
+    MSink *out = NULL;
+    MUniq *uniq = NULL;
+    bool unique = false;
+    bool stats = false;
+    int prune = 0;
+    int qbits = 0;
+    MConstraint cons = {0};
+    MConstrained *mc = NULL;
+    bool constrain = false;
+    RngKind kind = RNG_XOSHIRO;
+    bool setkind = false;
+    unsigned long seed = time(NULL);
+    unsigned long offset = 0;
+    bool setoffset = false;
     char *outf = NULL;
+    char *savef = NULL;
+    char *modelf = NULL;
+    char **modelfs = calloc(argc, sizeof(char*)); // Every --model, for --serve
+    int nmodelfs = 0;
+    char *servef = NULL;
+    char *tplspec = NULL;
+    char *metricsf = NULL;
+    char **binds = calloc(argc, sizeof(char*)); // Every --bind
+    int nbinds = 0;
     bool log = false;
+    bool bad = false;
+    int result = 0;
     FILE *f = NULL;
+    struct option longopts[] = {
+        {"save", required_argument, NULL, 'S'},
+        {"model", required_argument, NULL, 'M'},
+        {"unique", no_argument, NULL, 'U'},
+        {"add", required_argument, NULL, 'A'},
+        {"remove", required_argument, NULL, 'R'},
+        {"serve", required_argument, NULL, 'V'},
+        {"min-len", required_argument, NULL, 'L'},
+        {"max-len", required_argument, NULL, 'X'},
+        {"prefix", required_argument, NULL, 'P'},
+        {"suffix", required_argument, NULL, 'Q'},
+        {"forbid", required_argument, NULL, 'F'},
+        {"rng", required_argument, NULL, 'G'},
+        {"seed", required_argument, NULL, 'E'},
+        {"offset", required_argument, NULL, 'O'},
+        {"template", required_argument, NULL, 'T'},
+        {"bind", required_argument, NULL, 'B'},
+        {"stats", no_argument, NULL, 'Y'},
+        {"metrics", required_argument, NULL, 'W'},
+        {"prune", required_argument, NULL, 'N'},
+        {"quantize", required_argument, NULL, 'Z'},
+        {NULL, 0, NULL, 0}
+    };
+    cons.forbid = calloc(argc, sizeof(char*)); // Every --forbid
     opterr = 0; // Don't show default errors
-    while((c = getopt(argc,argv,"flhsgn:o:")) != -1) {
+    while(!bad &&
+            ((c = getopt_long(argc,argv,"flhsgn:o:k:b:j:",longopts,NULL)) != -1)) {
         switch(c) {
             case 'l':
                 log = true;
@@ -40,6 +234,9 @@ int main(int argc, char **argv) {
             case 's':
             case 'g':
                 i = generate_species(argc,argv);
+                free(modelfs);
+                free(binds);
+                free(cons.forbid);
                 return i;
             case 'h':
                 print_help();
@@ -48,79 +245,343 @@ int main(int argc, char **argv) {
                 n = atoi(optarg);
                 if(n < 1) {
                     fprintf(stderr, "%d is less than 1.\n",n);
-                    print_help();
-                    return -1;
+                    bad = true;
+                }
+                setn = true;
+                break;
+            case 'k':
+                order = atoi(optarg);
+                if((order < 1) || (order > KEYMAX)) {
+                    fprintf(stderr, "Order must be 1 to %d.\n", KEYMAX);
+                    bad = true;
+                }
+                break;
+            case 'b':
+                minobs = atoi(optarg);
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                if(nthreads < 1) {
+                    fprintf(stderr, "%d is less than 1.\n",nthreads);
+                    bad = true;
                 }
                 break;
             case 'o':
                 //When we setup writing output to a file it goes here
                 outf = strdup(optarg);
                 break;
+            case 'S':
+                savef = optarg;
+                break;
+            case 'M':
+                modelf = optarg;
+                modelfs[nmodelfs++] = optarg;
+                break;
+            case 'V':
+                servef = optarg;
+                break;
+            case 'U':
+                unique = true;
+                break;
+            case 'Y':
+                stats = true;
+                break;
+            case 'G':
+                if(rng_kind_from_name(optarg, &kind) < 0) {
+                    fprintf(stderr, "Unknown generator \"%s\", use mt, xoshiro or philox.\n", optarg);
+                    bad = true;
+                }
+                rng_set_default(kind);
+                setkind = true;
+                break;
+            case 'N':
+                prune = atoi(optarg);
+                if(prune < 1) {
+                    fprintf(stderr, "%d is less than 1.\n", prune);
+                    bad = true;
+                }
+                break;
+            case 'Z':
+                qbits = atoi(optarg);
+                if((qbits != 8) && (qbits != 16)) {
+                    fprintf(stderr, "Transitions can be quantized to 8 or 16 bits.\n");
+                    bad = true;
+                }
+                break;
+            case 'T':
+                tplspec = optarg;
+                break;
+            case 'W':
+                metricsf = optarg;
+                break;
+            case 'B':
+                binds[nbinds++] = optarg;
+                break;
+            case 'E':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'O':
+                offset = strtoul(optarg, NULL, 10);
+                setoffset = true;
+                break;
+            case 'L':
+                cons.minlen = atoi(optarg);
+                constrain = true;
+                break;
+            case 'X':
+                cons.maxlen = atoi(optarg);
+                if(cons.maxlen < 1) {
+                    fprintf(stderr, "%d is less than 1.\n", cons.maxlen);
+                    bad = true;
+                }
+                constrain = true;
+                break;
+            case 'P':
+                cons.prefix = optarg;
+                constrain = true;
+                break;
+            case 'Q':
+                cons.suffix = optarg;
+                constrain = true;
+                break;
+            case 'F':
+                if(optarg[0]) cons.forbid[cons.nforbid++] = optarg;
+                constrain = true;
+                break;
+            case 'A':
+            case 'R':
+                if(!corpus) corpus = create_arena(ARENASZ);
+                tmp = slist_load_dataset_arena(optarg, corpus);
+                if(!tmp) {
+                    fprintf(stderr, "Unable to load file: \"%s\"\n", optarg);
+                } else if((c == 'A') && addw) {
+                    slist_add(&addw, &tmp);
+                } else if(c == 'A') {
+                    addw = tmp;
+                } else if(remw) {
+                    slist_add(&remw, &tmp);
+                } else {
+                    remw = tmp;
+                }
+                tmp = NULL;
+                break;
             case '?':
-                if(optopt == 'n') {
-                    fprintf(stderr, "Option -n requires a number.\n");
+                if((optopt == 'n') || (optopt == 'k') || (optopt == 'b') ||
+                        (optopt == 'j')) {
+                    fprintf(stderr, "Option -%c requires a number.\n", optopt);
                 } else if(optopt == 'o') {
                     fprintf(stderr, "Option -o requires a filename.\n");
+                } else if(optopt && strchr("SMARVLXPQFGEOTBWNZ", optopt)) {
+                    for(i = 0; longopts[i].val != optopt; i++);
+                    fprintf(stderr, "Option --%s requires %s.\n",
+                            longopts[i].name, strchr("LXEON", optopt) ?
+                            "a number" : strchr("PQF", optopt) ?
+                            "a string" : (optopt == 'T') ?
+                            "a template" : (optopt == 'B') ?
+                            "name=file" : (optopt == 'G') ?
+                            "mt, xoshiro or philox" : (optopt == 'Z') ?
+                            "8 or 16" : "a filename");
                 } else if(isprint(optopt)) {
                     fprintf(stderr, "Unkown option \'-%c\'\n", optopt);
                 } else {
-                    fprintf(stderr,
-                          "Unkown option character \'\\x%x\'.\n",optopt);
+                    fprintf(stderr, "Unkown option \'%s\'\n", argv[optind-1]);
                 }
-                print_help();
-                return -1;
+                bad = true;
+                break;
             default:
                 break;
         }
     }
-    for(i = optind; i < argc; i++) {
-        if(!words) {
-            words = slist_load_dataset(argv[i]);
+    if(bad) {
+        print_help();
+        destroy_arena(corpus);
+        free(modelfs);
+        free(binds);
+        free(cons.forbid);
+        if(outf) free(outf);
+        return -1;
+    }
+    // Only generate names along with --save or --stats if -n was given
+    gen = setn || !(savef || stats);
+    if(metricsf) {
+        // Before any thread starts, see mmetrics_enable
+        if(mmetrics_enable(metricsf) < 0) {
+            fprintf(stderr, "Metrics will only be written at exit.\n");
+        }
+        atexit(mmetrics_dump);
+    }
+    if(setoffset && setkind && (kind != RNG_PHILOX)) {
+        fprintf(stderr, "--offset needs the philox generator.\n");
+        destroy_arena(corpus);
+        free(modelfs);
+        free(binds);
+        free(cons.forbid);
+        if(outf) free(outf);
+        return -1;
+    } else if(setoffset) {
+        // Only a counter based generator can start partway through
+        rng_set_default(RNG_PHILOX);
+    }
+    if(tplspec) {
+        i = templates(tplspec, binds, nbinds, n, outf, order, minobs, seed,
+                offset);
+        destroy_arena(corpus);
+        free(modelfs);
+        free(binds);
+        free(cons.forbid);
+        if(outf) free(outf);
+        return i;
+    }
+    if(servef) {
+        i = serve(servef, modelfs, nmodelfs, argv + optind, argc - optind,
+                order, minobs, nthreads);
+        destroy_arena(corpus);
+        free(modelfs);
+        free(binds);
+        free(cons.forbid);
+        if(outf) free(outf);
+        return i;
+    }
+    if(log) {
+        // Only the log needs the words themselves
+        if(!corpus) corpus = create_arena(ARENASZ);
+        for(i = optind; i < argc; i++) {
+            tmp = slist_load_dataset_arena(argv[i], corpus);
             if(!words) {
-                printf("Unable to load file: \"%s\"\n",argv[i]);
-            }
-        } else {
-            tmp = slist_load_dataset(argv[i]);
-            if(tmp) {
+                words = tmp;
+                tmp = NULL;
+            } else if(tmp) {
                 slist_add(&words,&tmp);
-            } else {
-                printf("Unable to load file: \"%s\"\n",argv[i]);
             }
         }
     }
 
-    if(words) {
-        ht = markov_generate_mht(words);
-        tmp = generate_random_word(ht,outf);
-        for(i = 0; i < n; i++) {
-            //slist_add(&tmp,&(generate_random_word(ht,outf)));
-            slist_push_node(&tmp, generate_random_word(ht,outf));
-        }
-        if(!outf) slist_print(tmp, ' ');
-        printf("\n");
-        if(log) {
-            f = fopen("log.txt","w+");
-            log_separator(f);
-            fprintf(f,"\nMarkov Word Generator Log File\n");
-            log_separator(f);
-            fprintf(f,"\nWords read from dataset:\n");
-            for(i = optind; i < argc; i++) {
-                fprintf(f,"\t%s\n",argv[i]);
-            }
-            fclose(f);
-            slist_write(words, ' ', "log.txt", "a+");
-            mht_write(ht, "log.txt", "a+");
+    if(modelf) {
+        ht = mht_load(modelf);
+        if(!ht) {
+            destroy_arena(corpus);
+            free(modelfs);
+            free(binds);
+            free(cons.forbid);
+            if(outf) free(outf);
+            return -1;
         }
-        destroy_slist(&tmp);
-        destroy_slist(&words);
+    } else if(optind < argc) {
+        ht = markov_train_files(argv + optind, argc - optind, order, nthreads);
+    }
+    if(ht && minobs) {
+        ht->minobs = minobs;
+    }
+    if(ht && addw) {
+        printf("%d words added\n", markov_add_words(ht, addw));
+    }
+    if(ht && remw) {
+        printf("%d words removed\n", markov_remove_words(ht, remw));
+    }
+    if(ht && ((prune > 1) || qbits) && (compact(ht, prune, qbits) < 0)) {
+        destroy_arena(corpus);
         destroy_mhtable(ht);
-    } 
+        free(modelfs);
+        free(binds);
+        free(cons.forbid);
+        if(outf) free(outf);
+        return -1;
+    }
+    if(ht && stats) {
+        fflush(stdout);
+        mht_write_stats(ht, stdout);
+    }
+    if(ht && savef) {
+        if(addw || remw || modelf) {
+            // Compact the model (and let go of the old file if it is the
+            // one being written)
+            mht_finalize(ht);
+        }
+        if(mht_save(ht, savef) == 0) {
+            printf("Model written to %s\n", savef);
+        } else {
+            result = -1;
+        }
+    }
 
-    if(outf) {
-        printf("%d words generated and written to %s\n", n, outf);
-        free(outf);
+    if(ht && gen && !ht->nstarts) {
+        fprintf(stderr, "No starter keys in the model, no names to generate\n");
+        gen = false;
+        result = -1;
+    }
+    if(ht && gen && constrain) {
+        // Stop here rather than print names that miss the constraints
+        mc = markov_constrain(ht, &cons);
+        if(!mc) {
+            gen = false;
+            result = -1;
+        }
+    }
+    if(ht && gen) {
+        if(outf) {
+            out = msink_open(outf, true);
+            if(!out) {
+                fprintf(stderr, "Error writing outfile: %s\n", outf);
+            }
+        }
+        if(!out) {
+            // Names go straight to the descriptor, don't let them pass stdio
+            fflush(stdout);
+            out = msink_create(STDOUT_FILENO, false);
+        }
+        if(out && unique) {
+            uniq = create_muniq(n);
+        }
+        if(out) {
+            i = markov_generate_batch(ht, n, nthreads, seed, offset, out,
+                    out->owned ? '\n' : ' ', uniq, mc);
+            if(out->owned) {
+                if(msink_close(out) < 0) {
+                    fprintf(stderr, "Error writing outfile: %s\n", outf);
+                    result = -1;
+                } else {
+                    printf("%d words generated and written to %s\n", i, outf);
+                }
+            } else {
+                msink_write(out, "\n", 1);
+                if(msink_close(out) < 0) result = -1;
+            }
+        }
+        if(uniq) {
+            fprintf(stderr, "%d unique names, %ld repeats drawn again "
+                    "(retry rate %.2f%%)\n", i, uniq->retries,
+                    (i + uniq->retries) ?
+                    100.0 * uniq->retries / (i + uniq->retries) : 0.0);
+            if(uniq->saturated) {
+                fprintf(stderr, "The model ran out of new names after %d, "
+                        "stopped short of %d\n", i, n);
+            }
+            destroy_muniq(uniq);
+        }
+    }
+    if(ht && log) {
+        f = fopen("log.txt","w+");
+        log_separator(f);
+        fprintf(f,"\nMarkov Word Generator Log File\n");
+        log_separator(f);
+        if(modelf) {
+            fprintf(f,"\nModel read from:\n\t%s\n", modelf);
+        }
+        fprintf(f,"\nWords read from dataset:\n");
+        for(i = optind; i < argc; i++) {
+            fprintf(f,"\t%s\n",argv[i]);
+        }
+        fclose(f);
+        if(words) slist_write(words, ' ', "log.txt", "a+");
+        mht_write(ht, "log.txt", "a+");
     }
+    destroy_mconstrained(mc);
+    destroy_arena(corpus);
+    if(ht) destroy_mhtable(ht);
+    free(modelfs);
+    free(binds);
+    free(cons.forbid);
+    if(outf) free(outf);
     
-    return 0;
+    return result;
 }
-
@@ -0,0 +1,180 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+
+/*****
+ * Batch generation
+ *****/
+typedef struct MBlock MBlock; // One block of names, generated by one thread
+
+struct MBlock {
+    MHTable *ht;            // Shared, read only
+    unsigned long seed;     // Seed of the whole batch
+    unsigned long first;    // Number of the block's first name in the seed
+    int id;                 // Block number, picks the rng stream
+    int n;                  // Names in this block
+    char sep;               // Written after each name
+    char *buf;              // Names generated
+    size_t len;             // Bytes used in buf
+    MUniq *uniq;            // Names already generated, NULL allows repeats
+    MConstrained *mc;       // Constraints the names meet, or NULL
+    int made;               // Names actually in buf
+    long retries;           // Repeats thrown away
+};
+
+static int markov_block_name(MBlock *b, Rng *rng) {
+    // Generate one name at the end of the block's buffer
+    if(b->mc) {
+        return markov_generate_constrained(b->mc, rng, b->buf + b->len, NAMEMAX);
+    }
+    return markov_generate_name(b->ht, rng, b->buf + b->len, NAMEMAX);
+}
+
+static void* markov_block_worker(void *arg) {
+    /* Generate every name of a block into its buffer. Each name is at most
+     * NAMEMAX characters with the separator, so the buffer never grows. */
+    MBlock *b = arg;
+    Rng rng;
+    uint64_t t = 0;
+    int len = 0;
+    int tries = 0;
+
+    rng_seed(&rng, b->seed, b->id);
+    b->len = 0;
+    b->retries = 0;
+    for(b->made = 0; b->made < b->n; b->made++) {
+        if(rng.kind == RNG_PHILOX) {
+            // Name k draws from stream k, whatever came before it (repeats
+            // thrown away for uniq carry on along the same stream)
+            rng_seed_kind(&rng, RNG_PHILOX, b->seed, b->first + b->made);
+        }
+        // Reading the clock costs a good part of a name, so only a sample of
+        // names is timed
+        t = (markov_metrics_on && !(b->made % MET_SAMPLE)) ? mmetrics_now() : 0;
+        len = markov_block_name(b, &rng);
+        if(b->uniq) {
+            // Draw again until the name is new, or give up if the model has
+            // stopped making new names
+            tries = 0;
+            while(!muniq_insert(b->uniq, b->buf + b->len) && (tries < UNIQTRIES)) {
+                tries++;
+                len = markov_block_name(b, &rng);
+            }
+            b->retries += tries;
+            if(markov_metrics_on) {
+                mmetrics_count(&(mmetrics_self()->retries), tries);
+            }
+            if(tries == UNIQTRIES) {
+                // Blocks run at the same time, read once they are joined
+                __atomic_store_n(&(b->uniq->saturated), true, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        if(t) mmetrics_record(MET_GEN, t);
+        b->len += len;
+        b->buf[b->len++] = b->sep;
+    }
+    return NULL;
+}
+
+int markov_generate_nth(MHTable *ht, MConstrained *mc, unsigned long seed,
+        unsigned long k, char *name, int cap) {
+    /* Name k of a seed with the Philox rng, on its own: the same name
+     * markov_generate_batch writes at that place for the same seed (and
+     * constraints, or none if mc is NULL), barring repeats dropped for a
+     * MUniq. Returns its length. */
+    Rng rng;
+    rng_seed_kind(&rng, RNG_PHILOX, seed, k);
+    if(mc) {
+        return markov_generate_constrained(mc, &rng, name, cap);
+    }
+    return markov_generate_name(ht, &rng, name, cap);
+}
+
+int markov_generate_batch(MHTable *ht, int n, int nthreads,
+        unsigned long seed, unsigned long offset, MSink *out, char sep,
+        MUniq *uniq, MConstrained *mc) {
+    /* Generate n names with nthreads threads and write them to out, each
+     * followed by sep. Threads work on consecutive blocks, then the blocks are
+     * handed to the sink in order before the next round starts; the sink's
+     * writer thread puts them on disk while the next round is generated.
+     * With uniq, every name is checked against (and added to) the set, and
+     * repeats are drawn again. Threads share the set, so which block gets a
+     * name first depends on timing and the output is only repeatable with one
+     * thread. A block gives up once UNIQTRIES repeats come in a row, and the
+     * repeats are added to uniq->retries. With mc, every name meets its
+     * constraints (see markov_constrain). With the Philox rng the names are
+     * names offset to offset + n - 1 of the seed, the same as running from 0
+     * and keeping the tail; other rngs ignore offset. Returns the number of names
+     * written, or -1 if the threads couldn't be started. */
+    MBlock *blocks = NULL;
+    pthread_t *threads = NULL;
+    int nblocks = ((long)n + BATCHSZ - 1) / BATCHSZ;
+    int done = 0;
+    int i = 0;
+    int m = 0;
+    int result = 0;
+
+    if(nthreads < 1) nthreads = 1;
+    if(nthreads > nblocks) nthreads = nblocks;
+    if(!nthreads) return 0;
+    blocks = calloc(nthreads, sizeof(MBlock));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for(i = 0; i < nthreads; i++) {
+        blocks[i].ht = ht;
+        blocks[i].seed = seed;
+        blocks[i].sep = sep;
+        blocks[i].uniq = uniq;
+        blocks[i].mc = mc;
+        blocks[i].buf = malloc((size_t)BATCHSZ * NAMEMAX);
+    }
+
+    while((done < nblocks) && (result >= 0) && !(uniq && uniq->saturated)) {
+        m = (nblocks - done < nthreads) ? nblocks - done : nthreads;
+        for(i = 0; i < m; i++) {
+            blocks[i].id = done + i;
+            blocks[i].first = offset + (unsigned long)(done + i) * BATCHSZ;
+            blocks[i].n = ((long)(done + i + 1) * BATCHSZ <= n) ? BATCHSZ :
+                n - (long)(done + i) * BATCHSZ;
+            if(pthread_create(&threads[i], NULL, markov_block_worker, &blocks[i]) != 0) {
+                fprintf(stderr, "Unable to start generator thread.\n");
+                result = -1;
+                m = i;
+                break;
+            }
+        }
+        for(i = 0; i < m; i++) {
+            pthread_join(threads[i], NULL);
+            if(result >= 0) {
+                msink_write(out, blocks[i].buf, blocks[i].len);
+                result += blocks[i].made;
+                if(uniq) uniq->retries += blocks[i].retries;
+            }
+        }
+        done += m;
+    }
+
+    for(i = 0; i < nthreads; i++) {
+        free(blocks[i].buf);
+    }
+    free(blocks);
+    free(threads);
+    return result;
+}
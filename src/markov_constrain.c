@@ -0,0 +1,485 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+
+/*****
+ * Constrained generation
+ *
+ * A name is a walk over chain states: the last (up to order) characters of
+ * the name, which pick the node its next character is drawn from. The
+ * substring constraints are followed with a small Aho-Corasick automaton over
+ * the forbidden substrings and the suffix. For every (chain state, automaton
+ * state, length) W holds the probability that carrying on from there ends in
+ * a name that meets every constraint. Each character is then drawn with its
+ * chain probability times the W it leads to, which is the chain's own
+ * distribution of names given the constraints, so nothing is thrown away.
+ *****/
+typedef struct MState MState; // A chain state
+
+struct MState {
+    char key[KEYMAX + 1];   // Last (up to order) characters of the name
+    unsigned int hash;      // Hash of key, for the state lookup
+    MHTNode *node;          // Node the next character is drawn from, or NULL
+    int succ;               // Index in MConstrained succ of its first follower
+    bool start;             // A start key, drawn from its own node (no backoff)
+};
+
+struct MConstrained {
+    MHTable *ht;
+    int minlen;
+    int maxlen;
+    char prefix[NAMEMAX];   // Lowercased, in symbols
+    int plen;
+    bool suffix;            // Names must end with the suffix
+    MState *states;         // Start states first, one per ht->starts
+    int nstates;
+    int *lookup;            // Open addressing, key -> state (or -1)
+    int lsize;
+    int nlookup;
+    int *succ;              // State each follower leads to, -1 for the end
+    double *p;              // Chain probability of each follower, as succ
+    char *ch;               // Character of each follower, as succ
+    int nsucc;
+    int (*ac)[256];         // Automaton transitions
+    unsigned char *acflags; // AC_DEAD, AC_SUFFIX
+    int nac;
+    double *w;              // See mc_w
+    double *start;          // Weight of each start in ht->starts
+    double starttotal;
+};
+
+enum {
+    AC_DEAD   = 1,          // A forbidden substring ends here
+    AC_SUFFIX = 2           // The suffix ends here
+};
+
+static double* mc_w(MConstrained *mc, int s, int a, int len) {
+    return &(mc->w[((size_t)s * mc->nac + a) * (mc->maxlen + 1) + len]);
+}
+
+/*****
+ * Automaton
+ *****/
+static void mc_ac_add(MConstrained *mc, char *pat, unsigned char flag) {
+    /* Add a pattern (in symbols) to the trie, mc_ac_build fills in the rest
+     * of the transitions */
+    unsigned char ch = 0;
+    int a = 0;
+    for(; *pat; pat++) {
+        ch = (unsigned char)*pat;
+        if(!mc->ac[a][ch]) {
+            mc->ac[a][ch] = mc->nac;
+            mc->nac += 1;
+        }
+        a = mc->ac[a][ch];
+    }
+    mc->acflags[a] |= flag;
+}
+
+static void mc_ac_build(MConstrained *mc) {
+    /* Breadth first over the trie. A missing transition goes where the
+     * failure state's does, and a state inherits its failure state's flags
+     * (a pattern ending there also ends here). Nothing points back at the
+     * root in the trie, so 0 can mean "no child". */
+    int *fail = calloc(mc->nac, sizeof(int));
+    int *queue = malloc(sizeof(int) * mc->nac);
+    int head = 0;
+    int tail = 0;
+    int a = 0;
+    int b = 0;
+    int c = 0;
+
+    for(c = 0; c < 256; c++) {
+        if(mc->ac[0][c]) queue[tail++] = mc->ac[0][c];
+    }
+    while(head < tail) {
+        a = queue[head++];
+        mc->acflags[a] |= mc->acflags[fail[a]];
+        for(c = 0; c < 256; c++) {
+            b = mc->ac[a][c];
+            if(b) {
+                fail[b] = mc->ac[fail[a]][c];
+                queue[tail++] = b;
+            } else {
+                mc->ac[a][c] = mc->ac[fail[a]][c];
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+}
+
+/*****
+ * Chain states
+ *****/
+static int mc_find_state(MConstrained *mc, char *key, unsigned int hash) {
+    // Slot of key in the lookup, or of the empty slot where it would go
+    int i = hash & (mc->lsize - 1);
+    while((mc->lookup[i] >= 0) &&
+            ((mc->states[mc->lookup[i]].hash != hash) ||
+             strcmp(mc->states[mc->lookup[i]].key, key))) {
+        i = (i + 1) & (mc->lsize - 1);
+    }
+    return i;
+}
+
+static int mc_add_state(MConstrained *mc, char *key, MHTNode *node,
+        bool start) {
+    // Append a state, -1 if there are already CONSTRAIN_STATES
+    MState *st = NULL;
+    if(mc->nstates == CONSTRAIN_STATES) return -1;
+    if(!(mc->nstates & (mc->nstates - 1))) {
+        // Grown at powers of two
+        mc->states = realloc(mc->states,
+                sizeof(MState) * (mc->nstates ? mc->nstates * 2 : 1));
+    }
+    st = &(mc->states[mc->nstates]);
+    strcpy(st->key, key);
+    st->hash = mht_hash(key);
+    st->node = node;
+    st->succ = -1;
+    st->start = start;
+    return mc->nstates++;
+}
+
+static int mc_state(MConstrained *mc, char *key) {
+    /* Index of the state for a name ending in key, adding it if it is new.
+     * -1 if there are too many states. */
+    unsigned int hash = mht_hash(key);
+    int i = mc_find_state(mc, key, hash);
+    int j = 0;
+
+    if(mc->lookup[i] >= 0) return mc->lookup[i];
+    j = mc_add_state(mc, key, markov_backoff_node(mc->ht, key, strlen(key),
+                mc->ht->dense ? dense_index(key, mc->ht->order) : -1), false);
+    if(j < 0) return -1;
+    mc->lookup[i] = j;
+    mc->nlookup += 1;
+    if(mc->nlookup * MAXLOAD > mc->lsize * (MAXLOAD - 1)) {
+        // Grow the lookup, the states themselves don't move
+        free(mc->lookup);
+        mc->lsize *= 2;
+        mc->lookup = malloc(sizeof(int) * mc->lsize);
+        memset(mc->lookup, -1, sizeof(int) * mc->lsize);
+        for(i = 0; i < mc->nstates; i++) {
+            if(!mc->states[i].start) {
+                mc->lookup[mc_find_state(mc, mc->states[i].key,
+                        mc->states[i].hash)] = i;
+            }
+        }
+    }
+    return j;
+}
+
+static bool mc_build_states(MConstrained *mc) {
+    /* A state for every start, then every state reachable from them. States
+     * are appended, so the array is its own queue. The followers of each
+     * state are copied out with their probabilities, whatever format the
+     * rows are in. False if there are too many. */
+    MHTable *ht = mc->ht;
+    MHTNode *node = NULL;
+    char next[KEYMAX + 2];
+    char ch = 0;
+    int capsucc = 0;
+    int len = 0;
+    int i = 0;
+    int j = 0;
+    int s = 0;
+
+    for(i = 0; i < ht->nstarts; i++) {
+        node = &(ht->items[ht->starts[i].slot]);
+        if(mc_add_state(mc, node->key, node, true) < 0) return false;
+    }
+    for(s = 0; s < mc->nstates; s++) {
+        node = mc->states[s].node;
+        if(!node) continue;
+        if(mc->nsucc + node->nnexts > capsucc) {
+            capsucc = (capsucc ? capsucc * 2 : 1024) + node->nnexts;
+            mc->succ = realloc(mc->succ, sizeof(int) * capsucc);
+            mc->p = realloc(mc->p, sizeof(double) * capsucc);
+            mc->ch = realloc(mc->ch, capsucc);
+        }
+        mc->states[s].succ = mc->nsucc;
+        mc->nsucc += node->nnexts;
+        mhtnode_probs(ht, node, mc->p + mc->states[s].succ);
+        len = strlen(mc->states[s].key);
+        for(j = 0; j < node->nnexts; j++) {
+            ch = mht_follow_ch(ht, node->first + j);
+            mc->ch[mc->states[s].succ + j] = ch;
+            i = -1;
+            if(ch) {
+                // The key grows by the follower, dropping its first
+                // character once it is order long
+                memcpy(next, mc->states[s].key, len);
+                next[len] = ch;
+                next[len + 1] = '\0';
+                i = mc_state(mc, next + ((len == ht->order) ? 1 : 0));
+                if(i < 0) return false;
+            }
+            mc->succ[mc->states[s].succ + j] = i;
+        }
+    }
+    return true;
+}
+
+/*****
+ * Success probabilities
+ *****/
+static bool mc_can_end(MConstrained *mc, int a, int len) {
+    return (len >= mc->minlen) && (len <= mc->maxlen) && (len >= mc->plen) &&
+        (!mc->suffix || (mc->acflags[a] & AC_SUFFIX));
+}
+
+static double mc_choice(MConstrained *mc, MState *st, int j, int a, int len) {
+    /* Weight of taking follower j of a state with a name of len characters
+     * ending in automaton state a: its chain probability times the chance of
+     * meeting the constraints afterwards */
+    double p = mc->p[st->succ + j];
+    char ch = mc->ch[st->succ + j];
+    int b = 0;
+
+    if(!ch) return mc_can_end(mc, a, len) ? p : 0;
+    if(len >= mc->maxlen) return 0;
+    if((len < mc->plen) && (ch != mc->prefix[len])) return 0;
+    b = mc->ac[a][(unsigned char)ch];
+    if(mc->acflags[b] & AC_DEAD) return 0;
+    return p * *mc_w(mc, mc->succ[st->succ + j], b, len + 1);
+}
+
+static void mc_build_w(MConstrained *mc) {
+    /* Fill W from the longest names back to the shortest */
+    MState *st = NULL;
+    double sum = 0;
+    int len = 0;
+    int s = 0;
+    int a = 0;
+    int j = 0;
+
+    for(len = mc->maxlen; len >= 0; len--) {
+        for(s = 0; s < mc->nstates; s++) {
+            st = &(mc->states[s]);
+            for(a = 0; a < mc->nac; a++) {
+                sum = 0;
+                if(mc->acflags[a] & AC_DEAD) {
+                    sum = 0;
+                } else if(!st->node) {
+                    // Nowhere to go, the name ends (as in markov_generate_name)
+                    sum = mc_can_end(mc, a, len) ? 1 : 0;
+                } else {
+                    for(j = 0; j < st->node->nnexts; j++) {
+                        sum += mc_choice(mc, st, j, a, len);
+                    }
+                }
+                *mc_w(mc, s, a, len) = sum;
+            }
+        }
+    }
+}
+
+static double mc_start_weight(MConstrained *mc, int s, int *pa) {
+    /* Chance that a name beginning with start state s meets the constraints.
+     * The key is checked against the prefix and run through the automaton,
+     * whose state is left in pa. */
+    char *key = mc->states[s].key;
+    int len = strlen(key);
+    int a = 0;
+    int i = 0;
+
+    if(len > mc->maxlen) return 0;
+    for(i = 0; i < len; i++) {
+        if((i < mc->plen) && (key[i] != mc->prefix[i])) return 0;
+        a = mc->ac[a][(unsigned char)key[i]];
+        if(mc->acflags[a] & AC_DEAD) return 0;
+    }
+    *pa = a;
+    return *mc_w(mc, s, a, len);
+}
+
+/*****
+ * Interface
+ *****/
+MConstrained* markov_constrain(MHTable *ht, MConstraint *c) {
+    /* Precompute everything needed to draw names from ht that meet c. The
+     * model must not change while the result is in use. Returns NULL, with a
+     * message, if no name can meet the constraints or the tables would be
+     * too big. */
+    MConstrained *mc = calloc(1, sizeof(MConstrained));
+    char *pat = NULL;
+    int npat = 1;
+    int a = 0;
+    int i = 0;
+
+    mc->ht = ht;
+    mc->maxlen = (ht->wmax < NAMEMAX - 1) ? ht->wmax : NAMEMAX - 1;
+    if((c->maxlen > 0) && (c->maxlen < mc->maxlen)) {
+        mc->maxlen = c->maxlen;
+    }
+    mc->minlen = (c->minlen > 1) ? c->minlen : 1;
+    if(c->prefix) {
+        // A character the model never saw can't start a name
+        strncpy(mc->prefix, c->prefix, NAMEMAX - 1);
+        mc->plen = markov_encode_word(ht, mc->prefix, false);
+        if(mc->plen < 0) {
+            fprintf(stderr, "No name from this model can meet the constraints\n");
+            destroy_mconstrained(mc);
+            return NULL;
+        }
+    }
+
+    // At most one automaton state per pattern character, plus the root
+    if(c->suffix) npat += strlen(c->suffix);
+    for(i = 0; i < c->nforbid; i++) {
+        npat += strlen(c->forbid[i]);
+    }
+    mc->ac = calloc(npat, sizeof(*mc->ac));
+    mc->acflags = calloc(npat, 1);
+    mc->nac = 1;
+    for(i = 0; i < c->nforbid; i++) {
+        // A pattern with a character the model never saw can't turn up
+        pat = strdup(c->forbid[i]);
+        if(markov_encode_word(ht, pat, false) >= 0) {
+            mc_ac_add(mc, pat, AC_DEAD);
+        }
+        free(pat);
+    }
+    if(c->suffix && c->suffix[0]) {
+        pat = strdup(c->suffix);
+        if(markov_encode_word(ht, pat, false) < 0) {
+            fprintf(stderr, "No name from this model can meet the constraints\n");
+            free(pat);
+            destroy_mconstrained(mc);
+            return NULL;
+        }
+        mc_ac_add(mc, pat, AC_SUFFIX);
+        mc->suffix = true;
+        free(pat);
+    }
+    mc_ac_build(mc);
+
+    mc->lsize = 1024;
+    mc->lookup = malloc(sizeof(int) * mc->lsize);
+    memset(mc->lookup, -1, sizeof(int) * mc->lsize);
+    if(!mc_build_states(mc) || ((double)mc->nstates * mc->nac *
+                (mc->maxlen + 1) > CONSTRAIN_CELLS)) {
+        fprintf(stderr, "The constraints need too large a table for this model\n");
+        destroy_mconstrained(mc);
+        return NULL;
+    }
+    mc->w = malloc(sizeof(double) * mc->nstates * mc->nac * (mc->maxlen + 1));
+    mc_build_w(mc);
+
+    mc->start = malloc(sizeof(double) * (ht->nstarts ? ht->nstarts : 1));
+    for(i = 0; i < ht->nstarts; i++) {
+        mc->start[i] = ht->starts[i].count * mc_start_weight(mc, i, &a);
+        mc->starttotal += mc->start[i];
+    }
+    if(mc->starttotal <= 0) {
+        fprintf(stderr, "No name from this model can meet the constraints\n");
+        destroy_mconstrained(mc);
+        return NULL;
+    }
+    return mc;
+}
+
+void destroy_mconstrained(MConstrained *mc) {
+    if(!mc) return;
+    free(mc->states);
+    free(mc->lookup);
+    free(mc->succ);
+    free(mc->p);
+    free(mc->ch);
+    free(mc->ac);
+    free(mc->acflags);
+    free(mc->w);
+    free(mc->start);
+    free(mc);
+}
+
+static double mc_uniform(Rng *rng) {
+    // Uniform in [0, 1), with 53 random bits
+    uint32_t hi = rng_u32(rng) >> 5;
+    uint32_t lo = rng_u32(rng) >> 6;
+    return (hi * 67108864.0 + lo) / 9007199254740992.0;
+}
+
+static int mc_pick(double *weights, int n, double total, Rng *rng) {
+    // Index drawn in proportion to weights, never one of weight 0
+    double u = mc_uniform(rng) * total;
+    int i = 0;
+    for(i = 0; i < n - 1; i++) {
+        if(weights[i] && (u < weights[i])) break;
+        u -= weights[i];
+    }
+    while(!weights[i]) i--; // Rounding ran past the last possible choice
+    return i;
+}
+
+int markov_generate_constrained(MConstrained *mc, Rng *rng, char *name,
+        int cap) {
+    /* Draw a name that meets the constraints, as markov_generate_name would
+     * but with every choice weighted by its chance of success. Only reads
+     * mc, so threads with their own rng can share it. The name is cut short
+     * (and may miss the constraints) only if cap is too small for it.
+     * Returns its length in bytes. */
+    double weights[256];
+    double total = 0;
+    MState *st = NULL;
+    char syms[NAMEMAX];
+    char ch = 0;
+    char *buf = mc->ht->nsyms ? syms : name;
+    int length = mc->ht->nsyms ? NAMEMAX - 1 : cap - 1;
+    int first = 0;
+    int len = 0;
+    int a = 0;
+    int s = 0;
+    int j = 0;
+
+    s = mc_pick(mc->start, mc->ht->nstarts, mc->starttotal, rng);
+    st = &(mc->states[s]);
+    len = strlen(st->key);
+    if(len > length) len = length;
+    memcpy(buf, st->key, len);
+    mc_start_weight(mc, s, &a);
+    first = len;
+
+    while(st->node && (len < length)) {
+        total = 0;
+        for(j = 0; j < st->node->nnexts; j++) {
+            weights[j] = mc_choice(mc, st, j, a, len);
+            total += weights[j];
+        }
+        if(total <= 0) break;
+        j = mc_pick(weights, st->node->nnexts, total, rng);
+        ch = mc->ch[st->succ + j];
+        if(!ch) break;
+        buf[len++] = ch;
+        a = mc->ac[a][(unsigned char)ch];
+        st = &(mc->states[mc->succ[st->succ + j]]);
+    }
+    if(markov_metrics_on) {
+        mmetrics_name(len - first, !st->node);
+    }
+    if(mc->ht->nsyms) {
+        return markov_decode_name(mc->ht, syms, len, name, cap, true);
+    }
+    name[len] = '\0';
+    name[0] = toupper(name[0]);
+    return len;
+}
@@ -0,0 +1,206 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/*****
+ * Corpus files
+ *****/
+int markov_corpus_open(MCorpus *c, char *fname) {
+    /* Map fname read only. Files that can't be mapped (pipes, some special
+     * files) are read into memory in large blocks instead. Returns 0 on
+     * success, -1 if the file can't be read. */
+    struct stat st;
+    size_t cap = 0;
+    ssize_t n = 0;
+    int fd = open(fname, O_RDONLY);
+
+    c->data = NULL;
+    c->len = 0;
+    c->mapped = false;
+    if(fd < 0) return -1;
+    if((fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+        if(st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        c->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(c->data != MAP_FAILED) {
+            madvise(c->data, st.st_size, MADV_SEQUENTIAL);
+            c->len = st.st_size;
+            c->mapped = true;
+            close(fd);
+            return 0;
+        }
+        c->data = NULL;
+    }
+    do {
+        if(c->len == cap) {
+            cap = cap ? cap * 2 : 1 << 20;
+            c->data = realloc(c->data, cap);
+        }
+        n = read(fd, c->data + c->len, cap - c->len);
+        if(n > 0) c->len += n;
+    } while(n > 0);
+    close(fd);
+    if(n < 0) {
+        markov_corpus_close(c);
+        return -1;
+    }
+    return 0;
+}
+
+void markov_corpus_close(MCorpus *c) {
+    if(c->mapped) {
+        munmap(c->data, c->len);
+    } else {
+        free(c->data);
+    }
+    c->data = NULL;
+    c->len = 0;
+    c->mapped = false;
+}
+
+/*****
+ * Streaming trainer
+ *****/
+typedef struct MStream MStream; // One thread's share of every corpus file
+
+struct MStream {
+    MHTable *ht;            // Table this thread counts into
+    const char *text;       // Range of the current file
+    size_t len;
+    char *word;             // Lowercased copy of the current word
+    int cap;                // Size of word
+};
+
+static void* markov_stream_worker(void *arg) {
+    /* Split the range on whitespace and count each word as it is found. The
+     * word is copied (lowercased) into a buffer that grows as needed, since
+     * the text itself is read only. */
+    MStream *st = arg;
+    uint64_t t = markov_metrics_on ? mmetrics_now() : 0;
+    size_t i = 0;
+    int len = 0;
+    char ch = 0;
+
+    for(i = 0; i <= st->len; i++) {
+        ch = (i < st->len) ? st->text[i] : ' ';
+        if(!isspace((unsigned char)ch)) {
+            if(len + 1 >= st->cap) {
+                st->cap = st->cap ? st->cap * 2 : 64;
+                st->word = realloc(st->word, st->cap);
+            }
+            st->word[len++] = tolower((unsigned char)ch);
+        } else if(len) {
+            st->word[len] = '\0';
+            markov_count_word(st->ht, st->word);
+            len = 0;
+        }
+    }
+    if(markov_metrics_on) mmetrics_record(MET_TRAIN, t);
+    return NULL;
+}
+
+static size_t markov_range_start(const char *text, size_t len, size_t pos) {
+    // Move pos forward to the start of a word, so no word is split in two
+    if(!pos) return 0;
+    while((pos < len) && !isspace((unsigned char)text[pos - 1])) {
+        pos++;
+    }
+    return pos;
+}
+
+MHTable* markov_train_files(char **files, int nfiles, int order, int nthreads) {
+    /* Train a table straight from corpus files, without building a word list.
+     * Each file is mapped and cut into nthreads ranges on word boundaries.
+     * Every thread counts its range of each file into its own table, and the
+     * tables are merged at the end, as in markov_generate_mht. Files that
+     * can't be read are reported and skipped. Returns NULL if none could be
+     * read. */
+    MStream *streams = NULL;
+    pthread_t *threads = NULL;
+    bool *started = NULL;
+    MHTable *ht = NULL;
+    MCorpus corpus;
+    size_t start = 0;
+    size_t end = 0;
+    int loaded = 0;
+    int i = 0;
+    int j = 0;
+
+    if(nthreads < 1) nthreads = 1;
+    streams = calloc(nthreads, sizeof(MStream));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    started = calloc(nthreads, sizeof(bool));
+    for(i = 0; i < nthreads; i++) {
+        streams[i].ht = create_mhtable(CAPACITY, order);
+    }
+
+    for(j = 0; j < nfiles; j++) {
+        if(markov_corpus_open(&corpus, files[j]) != 0) {
+            fprintf(stderr, "Unable to load file: \"%s\"\n", files[j]);
+            continue;
+        }
+        loaded++;
+        end = 0;
+        for(i = 0; i < nthreads; i++) {
+            start = end;
+            end = (i + 1 == nthreads) ? corpus.len : corpus.len / nthreads * (i + 1);
+            end = markov_range_start(corpus.data, corpus.len,
+                    (end < start) ? start : end);
+            streams[i].text = corpus.data + start;
+            streams[i].len = end - start;
+        }
+        // Range 0 is counted on this thread, as is any range whose thread fails
+        for(i = 1; i < nthreads; i++) {
+            started[i] = (pthread_create(&threads[i], NULL,
+                        markov_stream_worker, &streams[i]) == 0);
+        }
+        markov_stream_worker(&streams[0]);
+        for(i = 1; i < nthreads; i++) {
+            if(started[i]) {
+                pthread_join(threads[i], NULL);
+            } else {
+                markov_stream_worker(&streams[i]);
+            }
+        }
+        markov_corpus_close(&corpus);
+    }
+
+    ht = streams[0].ht;
+    free(streams[0].word);
+    for(i = 1; i < nthreads; i++) {
+        mht_merge(ht, streams[i].ht);
+        destroy_mhtable(streams[i].ht);
+        free(streams[i].word);
+    }
+    free(streams);
+    free(threads);
+    free(started);
+    if(!loaded) {
+        destroy_mhtable(ht);
+        return NULL;
+    }
+    mht_finalize(ht);
+    return ht;
+}
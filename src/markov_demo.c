@@ -28,53 +28,90 @@ void log_separator(FILE *f) {
 }
 
 void print_help(void) {
-    printf("Usage:\n\tmarkov [-l] [-n number] [-o outfile] infile1 [infile2...]\n");
-    printf("\tmarkov -g infile1 -s infile2 [-l -f] [-n number] [-o outfile]\n");
-    printf("Where:\n\tinfile1 [infile2...] are data files containing space separated words\n");
+    printf("Usage:\n\tmarkov [-l] [-n number] [-o outfile] [-k order] [-b count] [-j threads] [--rng gen] [--seed S [--offset k]] [--unique] [constraints] [--metrics file] infile1 [infile2...]\n");
+    printf("\tmarkov [-k order] [-b count] [--prune count] [--quantize bits] [--stats] --save model infile1 [infile2...]\n");
+    printf("\tmarkov --model model [--add file] [--remove file] [--prune count] [--quantize bits] [--save model] [--stats] [-l] [-n number] [-o outfile] [-b count] [-j threads] [--rng gen] [--seed S [--offset k]] [--unique] [constraints]\n");
+    printf("\tmarkov --serve socket [--model model...] [-k order] [-b count] [-j threads] [--metrics file] [infile1...]\n");
+    printf("\tmarkov --template spec [--bind name=file...] [-n number] [-o outfile] [-k order] [-b count] [--rng gen] [--seed S [--offset k]]\n");
+    printf("\tmarkov -g infile1 -s infile2 [-l -f] [-n number] [-o outfile] [-k order] [-b count]\n");
+    printf("Where:\n\tinfile1 [infile2...] are data files containing space separated words, in UTF-8 (or Latin-1),\n");
+    printf("\t\twith up to %d different non-ASCII letters per model\n", UTF8_SYMS);
     printf("\t[-l] writes a log file to \"log.txt\" in the current directory\n");
     printf("\t[-n number] is number of names to generate\n");
     printf("\t[-o outfile] is the file to write the output to\n");
+    printf("\t[-k order] is the longest key used in the chain, 1 to %d (default %d)\n", KEYMAX, KEYSZ);
+    printf("\t[-b count] backs off to shorter keys seen fewer than count times (default %d)\n", BACKOFF);
+    printf("\t[-j threads] trains and generates names on this many threads\n");
+    printf("\t[--save model] writes the trained model to a binary model file\n");
+    printf("\t[--stats] prints the model's statistics as JSON: contexts, load factor and probe lengths, branching,\n");
+    printf("\t\tentropy, dead ends, starts and memory (names are only generated if -n is given too)\n");
+    printf("\t[--model model] generates from a model file instead of training\n");
+    printf("\t[--add file] [--remove file] adds or takes back the words in file, on a trained or loaded model\n");
+    printf("\t[--prune count] drops transitions seen fewer than count times, and contexts left with none\n");
+    printf("\t[--quantize bits] keeps only each context's sampling table, in 8 or 16 bit steps, instead of its counts;\n");
+    printf("\t\tboth report the memory saved and how far the next character distributions moved: total variation,\n");
+    printf("\t\tKL divergence over the transitions kept (renormalized), and the probability lost to dropped ones\n");
+    printf("\t[--serve socket] keeps the models loaded and answers \"GEN model n [seed]\" and \"LIST\" lines on a unix socket,\n");
+    printf("\t\teach model named after its file, with -j worker threads\n");
+    printf("\t[--rng gen] picks the random number generator: xoshiro (default, fastest), mt (MT19937, as before)\n");
+    printf("\t\tor philox (counter based: name k of a seed is the same however it is reached)\n");
+    printf("\t[--seed S] seeds the generator (default the time), so the same names can be made again\n");
+    printf("\t[--offset k] starts at name k of the seed, without making names 0 to k-1 (uses philox)\n");
+    printf("\t[--unique] never writes the same name twice, and reports how often a repeat was drawn\n");
+    printf("\t[constraints] are any of [--min-len n] [--max-len n] [--prefix str] [--suffix str] [--forbid str...];\n");
+    printf("\t\tevery name meets them, drawn as the model would given the constraints, with nothing thrown away\n");
+    printf("\t[--template spec] makes names of several parts, e.g. \"{fnames} {mnames} of {fish:lower}\": each {name} is a name\n");
+    printf("\t\tfrom the model trained on data/name.txt, :lower, :upper or :title change its case, {{ and }} are braces\n");
+    printf("\t[--bind name=file] trains {name} on file instead, or loads it if file is a saved model\n");
+    printf("\t[--metrics file] records latency histograms (training, each name, each write, each request) and counters,\n");
+    printf("\t\tand appends them to file (\"-\" for stderr) as JSON at exit and whenever the process gets SIGUSR1\n");
     printf("\t-g infile1 -s infile2 are input data for a \"Genre species\" output\n");
     printf("\t[-f] when used with -g -s, prints output as a \"First Last\" word.\n");
     printf("Example: \"markov -n 100 data1.txt data2.txt\" ");
     printf("will generate 100 random names\n using data1.txt and data2.txt as input.\n");
     printf("Example: \"markov -n 100 -o out.txt -g data1.txt -s data2.txt\" ");
     printf("will generate 100 random \"Genre species\" style names, and write them to \"out.txt\"\n");
+    printf("Example: \"markov --save names.mkv data1.txt\" then \"markov --model names.mkv -n 100\" ");
+    printf("trains once and generates from the saved model.\n");
 }
 
 int generate_species(int argc,char **argv) {
+    /* "Genre species" names, the template "{g} {s:lower}" (or "{g} {s}" for
+     * "First Last") with g and s bound to the -g and -s files */
     int c = 0;
     int i = 0;
     int n = 10;
-    SList *genredat = NULL;
-    SList *speciesdat = NULL;
-    SList *genre = NULL;
-    SList *species = NULL;
-    SList *itg = NULL;
-    SList *its = NULL;
+    int order = KEYSZ;
+    int minobs = BACKOFF;
+    int result = 0;
     char *outf = NULL;
+    MTemplate *t = NULL;
     MHTable *ht = NULL;
+    MSink *out = NULL;
     FILE *f = NULL;
     bool log = false;
     bool firstlast = false;
     char *gfile = NULL;
     char *sfile = NULL;
+    char *bind = NULL;
+    char *name = NULL;
+    Arena *corpus = NULL; // Holds the word lists for the log
     opterr = 0; // Don't show default errors
     optind = 0; // Reset since we are reloading getopt
-    while((c = getopt(argc,argv,"flhn:o:g:s:")) != -1) {
+    while((c = getopt(argc,argv,"flhn:o:g:s:k:b:")) != -1) {
         switch(c) {
             case 'l':
                 log = true;
                 break;
             case 'g':
-                genredat = slist_load_dataset(optarg);
+                if(gfile) free(gfile);
                 gfile = strdup(optarg);
                 break;
             case 'f':
                 firstlast = true;
                 break;
             case 's':
-                speciesdat = slist_load_dataset(optarg);
+                if(sfile) free(sfile);
                 sfile = strdup(optarg);
                 break;
             case 'h':
@@ -88,12 +125,23 @@ int generate_species(int argc,char **argv) {
                     return -1;
                 }
                 break;
+            case 'k':
+                order = atoi(optarg);
+                if((order < 1) || (order > KEYMAX)) {
+                    fprintf(stderr, "Order must be 1 to %d.\n", KEYMAX);
+                    print_help();
+                    return -1;
+                }
+                break;
+            case 'b':
+                minobs = atoi(optarg);
+                break;
             case 'o':
                 outf = strdup(optarg);
                 break;
             case '?':
-                if(optopt == 'n') {
-                    fprintf(stderr, "Option -n requires a number.\n");
+                if((optopt == 'n') || (optopt == 'k') || (optopt == 'b')) {
+                    fprintf(stderr, "Option -%c requires a number.\n", optopt);
                 } else if(optopt == 'o' || optopt == 'g' || optopt == 's') {
                     fprintf(stderr, "Option -%c requires a filename.\n",optopt);
                 } else if(isprint(optopt)) {
@@ -103,8 +151,6 @@ int generate_species(int argc,char **argv) {
                           "Unkown option character \'\\x%x\'.\n",optopt);
                 }
                 print_help();
-                destroy_slist(&genredat);
-                destroy_slist(&speciesdat);
                 if(outf) free(outf);
                 if(gfile) free(gfile);
                 if(sfile) free(sfile);
@@ -112,18 +158,32 @@ int generate_species(int argc,char **argv) {
                 break;
         }
     }
-    if(!genredat || !speciesdat) {
+    if(!gfile || !sfile) {
         fprintf(stderr, "Missing genre or species file (-g [genrefile] -s [speciesfile])\n");
         print_help();
-        destroy_slist(&genredat);
-        destroy_slist(&speciesdat);
         if(outf) free(outf);
         if(gfile) free(gfile);
         if(sfile) free(sfile);
         return -1;
     }
-    
+
+    t = markov_template_parse(firstlast ? "{g} {s}" : "{g} {s:lower}");
+    bind = malloc(strlen(gfile) + strlen(sfile) + 3);
+    sprintf(bind, "g=%s", gfile);
+    markov_template_bind(t, bind);
+    sprintf(bind, "s=%s", sfile);
+    markov_template_bind(t, bind);
+    free(bind);
+    if(markov_template_load(t, "data", order, minobs) < 0) {
+        destroy_mtemplate(t);
+        if(outf) free(outf);
+        free(gfile);
+        free(sfile);
+        return -1;
+    }
+
     if(log) {
+        corpus = create_arena(ARENASZ);
         f = fopen("log.txt","w+");
         log_separator(f);
         fprintf(f,"\nMarkov Word Generator Log File\n");
@@ -132,84 +192,56 @@ int generate_species(int argc,char **argv) {
         fprintf(f,"\nWords read from datasets:\n");
         fprintf(f,"Genre: %s\n",gfile);
         fclose(f);
-        slist_write(genredat, ' ', "log.txt","a+");
+        slist_write(slist_load_dataset_arena(gfile, corpus), ' ', "log.txt","a+");
         f = fopen("log.txt","a+");
         log_separator(f);
         fprintf(f,"\nSpecies: %s\n",sfile);
         fclose(f);
-        slist_write(speciesdat, ' ', "log.txt","a+");
+        slist_write(slist_load_dataset_arena(sfile, corpus), ' ', "log.txt","a+");
         f = fopen("log.txt","a+");
         fprintf(f,"\n");
         log_separator(f);
         fclose(f);
+        for(i = 0; (ht = markov_template_model(t, i, &name)); i++) {
+            f = fopen("log.txt","a+");
+            fprintf(f,"\nHash table from %s:\n", (name[0] == 'g') ? gfile : sfile);
+            fclose(f);
+            mht_write(ht, "log.txt","a+");
+        }
+        destroy_arena(corpus);
     }
 
-    //Generate genre
-    ht = markov_generate_mht(genredat);
-    genre = generate_random_word(ht, NULL);
-    for(i = 0; i < n; i++) {
-        //slist_add(&genre, &(generate_random_word(ht, NULL)));
-        slist_push_node(&genre, generate_random_word(ht, NULL));
-    }
-    if (log) {
-        f = fopen("log.txt","a+");
-        fprintf(f,"\nHash table from %s:\n",gfile);
-        fclose(f);
-        mht_write(ht, "log.txt","a+");
-    }
-    destroy_mhtable(ht);
-
-    //Generate species
-    ht = markov_generate_mht(speciesdat);
-    species = generate_random_word(ht, NULL);
-    for(i = 0; i < n; i++) {
-        //slist_add(&species, &generate_random_word(ht, NULL));
-        slist_push_node(&species, generate_random_word(ht, NULL));
-    }
-    if (!firstlast) {
-        slist_to_lower(species);
-    }
-    if (log) {
-        f = fopen("log.txt","a+");
-        fprintf(f,"Hash table from %s:\n",sfile);
-        fclose(f);
-        mht_write(ht, "log.txt","a+");
-    }
-    destroy_mhtable(ht);
-
-    //Write outf
+    //Write outf, or stdout, one name at a time
     if(outf) {
-        f = fopen(outf, "w+");
-        if(!f) {
-            printf("Error writing outfile: %s\n",outf);
+        out = msink_open(outf, false);
+        if(!out) {
+            fprintf(stderr, "Error writing outfile: %s\n", outf);
+            destroy_mtemplate(t);
+            free(outf);
+            free(gfile);
+            free(sfile);
             return -1;
         }
-        itg = genre;
-        its = species;
-        while(itg) {
-            fprintf(f,"%s %s\n", itg->data, its->data);
-            itg = itg->next;
-            its = its->next;
-        }
-        fclose(f);
-        printf("%d \"Genre species\" written to %s\n",n,outf);
-        free(outf);
     } else {
-        itg = genre;
-        its = species;
-        while(itg && its) {
-            printf("%s %s\n", itg->data, its->data);
-            itg = itg->next;
-            its = its->next;
+        fflush(stdout);
+        out = msink_create(STDOUT_FILENO, false);
+    }
+    markov_template_batch(t, n, time(NULL), 0, out, '\n');
+    if(msink_close(out) < 0) {
+        if(outf) {
+            fprintf(stderr, "Error writing outfile: %s\n", outf);
+        } else {
+            fprintf(stderr, "Error writing output\n");
         }
+        result = -1;
+    } else if(outf) {
+        printf("%d \"Genre species\" written to %s\n",n,outf);
     }
     
     // Cleanup
+    if(outf) free(outf);
     free(gfile);
     free(sfile);
-    destroy_slist(&genredat);
-    destroy_slist(&speciesdat);
-    destroy_slist(&genre);
-    destroy_slist(&species);
-    return 0;
+    destroy_mtemplate(t);
+    return result;
 }
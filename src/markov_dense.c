@@ -0,0 +1,73 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+
+/*****
+ * Dense engine
+ *
+ * ht->dense has one entry per packed key (ht->drows of them), holding the
+ * slot the key lives in or -1. Tables up to DENSE_MAXORDER start out dense and
+ * drop to plain hashing the first time a key or follower outside the alphabet
+ * shows up.
+ *****/
+void mht_create_dense(MHTable *ht) {
+    int i = 0;
+    ht->dense = NULL;
+    ht->drows = 0;
+    // DENSE_ALPHA^order overflows an int well before KEYMAX
+    if(ht->order > DENSE_MAXORDER) return;
+    ht->drows = 1;
+    for(i = 0; i < ht->order; i++) {
+        ht->drows *= DENSE_ALPHA;
+    }
+    ht->dense = malloc(sizeof(int) * ht->drows);
+    for(i = 0; i < ht->drows; i++) {
+        ht->dense[i] = -1;
+    }
+}
+
+void mht_drop_dense(MHTable *ht) {
+    // The corpus doesn't fit the dense alphabet, fall back to the hash table
+    if(!ht->arena && !ht->map) {
+        free(ht->dense);
+    }
+    ht->dense = NULL;
+}
+
+void mht_rebuild_dense(MHTable *ht) {
+    /* Slots moved (the table was resized), point every packed key at its new
+     * slot */
+    int i = 0;
+    if(!ht->dense) return;
+    for(i = 0; i < ht->drows; i++) {
+        ht->dense[i] = -1;
+    }
+    for(i = 0; i < ht->size; i++) {
+        if(ht->items[i].key[0]) {
+            ht->dense[dense_index(ht->items[i].key, ht->order)] = i;
+        }
+    }
+}
+
+MHTNode* mht_dense_node(MHTable *ht, int i) {
+    // Node for packed key i, NULL if the key was never seen
+    if((i < 0) || (ht->dense[i] < 0)) return NULL;
+    return &(ht->items[ht->dense[i]]);
+}
@@ -0,0 +1,284 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/*****
+ * Model file helpers
+ *****/
+static uint64_t mkv_checksum(uint64_t h, const void *data, size_t n) {
+    // FNV-1a, started with h so the arrays can be fed in one at a time
+    const unsigned char *p = data;
+    size_t i = 0;
+    for(i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t mkv_align(uint64_t ofs) {
+    return (ofs + MKV_ALIGN - 1) & ~((uint64_t)MKV_ALIGN - 1);
+}
+
+static uint64_t mkv_write_array(FILE *f, uint64_t *ofs, uint64_t *sum,
+        const void *data, size_t n) {
+    /* Pad the file to the next MKV_ALIGN boundary, write n bytes of data and
+     * return the offset they start at. Padding is zeros and is part of the
+     * checksum. */
+    static const char zeros[MKV_ALIGN] = {0};
+    uint64_t start = mkv_align(*ofs);
+    fwrite(zeros, 1, start - *ofs, f);
+    *sum = mkv_checksum(*sum, zeros, start - *ofs);
+    if(n) {
+        fwrite(data, 1, n, f);
+        *sum = mkv_checksum(*sum, data, n);
+    }
+    *ofs = start + n;
+    return start;
+}
+
+static int mkv_follow_alias(MHTable *ht, int i) {
+    // Alias of follower i of the pool, whatever the format
+    if(!ht->qfollows) return ht->follows[i].alias;
+    if(ht->qbits == 8) return ((MFollower8*)ht->qfollows)[i].alias;
+    return ((MFollower16*)ht->qfollows)[i].alias;
+}
+
+static char* mkv_check(MHTable *ht) {
+    /* Check that every index stored in a loaded table points inside it, so a
+     * damaged file with a good checksum can't send a lookup out of bounds.
+     * Returns what is wrong, or NULL. */
+    MHTNode *node = NULL;
+    int i = 0;
+    int j = 0;
+
+    for(i = 0; i < ht->size; i++) {
+        node = &(ht->items[i]);
+        if(!node->key[0]) continue;
+        if(node->key[KEYMAX] || (node->first < 0) || (node->nnexts < 0) ||
+                (node->nnexts > 256) ||
+                ((long)node->first + node->nnexts > ht->nfollows)) {
+            return "bad key or follower row";
+        }
+        for(j = 0; j < node->nnexts; j++) {
+            if(mkv_follow_alias(ht, node->first + j) >= node->nnexts) {
+                return "bad follower alias";
+            }
+        }
+    }
+    for(i = 0; i < ht->nstarts; i++) {
+        if((ht->starts[i].slot < 0) || (ht->starts[i].slot >= ht->size) ||
+                !ht->items[ht->starts[i].slot].key[0] ||
+                (ht->starts[i].alias < 0) ||
+                (ht->starts[i].alias >= ht->nstarts)) {
+            return "bad start";
+        }
+    }
+    for(i = 0; ht->dense && (i < ht->drows); i++) {
+        if((ht->dense[i] < -1) || (ht->dense[i] >= ht->size) ||
+                ((ht->dense[i] >= 0) && !ht->items[ht->dense[i]].key[0])) {
+            return "bad dense row";
+        }
+    }
+    return NULL;
+}
+
+/*****
+ * Model file functions
+ *****/
+int mht_save(MHTable *ht, char *fname) {
+    /* Write a finalized table to fname. Returns 0 on success, -1 (and no
+     * file) if the file couldn't be written. */
+    MKVHeader hdr;
+    struct stat st;
+    bool failed = false;
+    bool regular = false;
+    FILE *f = fopen(fname, "wb");
+    uint64_t ofs = sizeof(MKVHeader);
+    uint64_t sum = 0xcbf29ce484222325ULL;
+
+    if(!f) {
+        fprintf(stderr, "Unable to write model file: \"%s\"\n", fname);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(MKVHeader));
+    memcpy(hdr.magic, "MKV", 4);
+    hdr.version = MKV_VERSION;
+    hdr.endian = MKV_ENDIAN;
+    hdr.hdrsize = sizeof(MKVHeader);
+    hdr.order = ht->order;
+    hdr.minobs = ht->minobs;
+    hdr.wmin = ht->wmin;
+    hdr.wmax = ht->wmax;
+    hdr.size = ht->size;
+    hdr.count = ht->count;
+    hdr.nfollows = ht->nfollows;
+    hdr.nstarts = ht->nstarts;
+    hdr.drows = ht->dense ? ht->drows : 0;
+    hdr.nsyms = ht->nsyms;
+    hdr.qbits = ht->qfollows ? ht->qbits : 0;
+
+    // Header goes in last, once the offsets and checksum are known
+    fwrite(&hdr, sizeof(MKVHeader), 1, f);
+    hdr.items = mkv_write_array(f, &ofs, &sum, ht->items,
+            sizeof(MHTNode) * ht->size);
+    hdr.follows = mkv_write_array(f, &ofs, &sum,
+            ht->qfollows ? ht->qfollows : (void*)ht->follows,
+            (size_t)mht_follow_size(ht) * ht->nfollows);
+    hdr.starts = mkv_write_array(f, &ofs, &sum, ht->starts,
+            sizeof(MStart) * ht->nstarts);
+    hdr.dense = mkv_write_array(f, &ofs, &sum, ht->dense,
+            sizeof(int) * hdr.drows);
+    hdr.lens = mkv_write_array(f, &ofs, &sum, ht->lens,
+            sizeof(unsigned int) * NAMEMAX);
+    hdr.syms = mkv_write_array(f, &ofs, &sum, ht->syms,
+            sizeof(unsigned int) * hdr.nsyms);
+    hdr.filesize = ofs;
+    hdr.checksum = sum;
+    fseek(f, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(MKVHeader), 1, f);
+    // The writes above are checked here, all at once
+    failed = (ferror(f) != 0);
+    regular = (fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode);
+    if((fclose(f) != 0) || failed) {
+        fprintf(stderr, "Unable to write model file: \"%s\"\n", fname);
+        // Don't leave a truncated model behind (but leave devices alone)
+        if(regular) remove(fname);
+        return -1;
+    }
+    return 0;
+}
+
+MHTable* mht_load(char *fname) {
+    /* Map a model file written by mht_save and return a table that uses the
+     * mapping directly. The header, checksum and every stored index are
+     * checked, nothing else is copied or rebuilt. Returns NULL (with a
+     * message) on any problem. */
+    MHTable *ht = NULL;
+    MKVHeader *hdr = NULL;
+    struct stat st;
+    int drows = 1;
+    int i = 0;
+    char *base = NULL;
+    char *err = NULL;
+    int fd = open(fname, O_RDONLY);
+
+    if(fd < 0) {
+        fprintf(stderr, "Unable to open model file: \"%s\"\n", fname);
+        return NULL;
+    }
+    if((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(MKVHeader))) {
+        close(fd);
+        fprintf(stderr, "Not a model file: \"%s\"\n", fname);
+        return NULL;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "Unable to map model file: \"%s\"\n", fname);
+        return NULL;
+    }
+
+    hdr = (MKVHeader*)base;
+    if(memcmp(hdr->magic, "MKV", 4) != 0) {
+        err = "not a model file";
+    } else if(hdr->endian != MKV_ENDIAN) {
+        err = "written on a machine with a different byte order";
+    } else if((hdr->version != MKV_VERSION) || 
+            (hdr->hdrsize != sizeof(MKVHeader))) {
+        err = "unsupported model file version";
+    } else if((hdr->order < 1) || (hdr->order > KEYMAX) ||
+            (hdr->size < 1) || (hdr->size & (hdr->size - 1)) ||
+            // A full table leaves a missing key probing forever
+            (hdr->count < 0) || (hdr->count >= hdr->size) ||
+            (hdr->wmin < 0) || (hdr->wmax < 0) || (hdr->wmin > hdr->wmax) ||
+            (hdr->wmax > NAMEMAX) ||
+            (hdr->nfollows < 0) || (hdr->nstarts < 0) || (hdr->drows < 0) ||
+            (hdr->nsyms < 0) || (hdr->nsyms > UTF8_SYMS) ||
+            ((hdr->qbits != 0) && (hdr->qbits != 8) && (hdr->qbits != 16))) {
+        err = "model file is damaged";
+    } else if((hdr->filesize != (uint64_t)st.st_size) || 
+            (hdr->items + sizeof(MHTNode) * (uint64_t)hdr->size > hdr->filesize) ||
+            (hdr->follows + (uint64_t)(!hdr->qbits ? sizeof(MFollower) :
+                (hdr->qbits == 8) ? sizeof(MFollower8) : sizeof(MFollower16)) *
+                hdr->nfollows > hdr->filesize) ||
+            (hdr->starts + sizeof(MStart) * (uint64_t)hdr->nstarts > hdr->filesize) ||
+            (hdr->dense + sizeof(int) * (uint64_t)hdr->drows > hdr->filesize) ||
+            (hdr->lens + sizeof(unsigned int) * NAMEMAX > hdr->filesize) ||
+            (hdr->syms + sizeof(unsigned int) * (uint64_t)hdr->nsyms > hdr->filesize) ||
+            ((hdr->items | hdr->follows | hdr->starts | hdr->dense |
+              hdr->lens | hdr->syms) % MKV_ALIGN)) {
+        err = "model file is truncated or damaged";
+    } else if(mkv_checksum(0xcbf29ce484222325ULL, base + sizeof(MKVHeader),
+                st.st_size - sizeof(MKVHeader)) != hdr->checksum) {
+        err = "checksum mismatch";
+    } else if(hdr->drows && (hdr->order > DENSE_MAXORDER)) {
+        err = "model file is damaged";
+    } else if(hdr->drows) {
+        // A dense model has a row for every packed key
+        for(i = 0; i < hdr->order; i++) {
+            drows *= DENSE_ALPHA;
+        }
+        if(hdr->drows != drows) err = "model file is damaged";
+    }
+    if(err) {
+        fprintf(stderr, "Unable to load model \"%s\": %s\n", fname, err);
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    ht = malloc(sizeof(MHTable));
+    memset(ht, 0, sizeof(MHTable));
+    ht->order = hdr->order;
+    ht->minobs = hdr->minobs;
+    ht->wmin = hdr->wmin;
+    ht->wmax = hdr->wmax;
+    memcpy(ht->lens, base + hdr->lens, sizeof(unsigned int) * NAMEMAX);
+    ht->nsyms = hdr->nsyms;
+    memcpy(ht->syms, base + hdr->syms, sizeof(unsigned int) * hdr->nsyms);
+    mht_index_symbols(ht);
+    ht->size = hdr->size;
+    ht->count = hdr->count;
+    ht->nfollows = hdr->nfollows;
+    ht->fcap = hdr->nfollows;
+    ht->nstarts = hdr->nstarts;
+    ht->items = (MHTNode*)(base + hdr->items);
+    ht->qbits = hdr->qbits;
+    if(hdr->qbits) {
+        ht->qfollows = base + hdr->follows;
+    } else {
+        ht->follows = (MFollower*)(base + hdr->follows);
+    }
+    ht->starts = (MStart*)(base + hdr->starts);
+    ht->drows = hdr->drows;
+    ht->dense = hdr->drows ? (int*)(base + hdr->dense) : NULL;
+    ht->map = base;
+    ht->mapsize = st.st_size;
+    err = mkv_check(ht);
+    if(err) {
+        fprintf(stderr, "Unable to load model \"%s\": %s\n", fname, err);
+        destroy_mhtable(ht);
+        return NULL;
+    }
+    return ht;
+}
@@ -21,98 +21,386 @@
 /*****
  * Markov chain generator functions
  *****/
-MHTable* markov_generate_mht(SList *words) {
-    /* This function does the following:
-     * - Open the dataset file (fname)
-     * - Read and store strings in SList (words)
-     * - Loop through SList (words), doing:
-     *   = take first two characters of string (a1a2, "key")
-     *   = call markov_find_match(key, words)
-     *   markov_find_match(key, words) Does the following:
-     *   -= Look through SList (words) for any two characters that match key
-     *   -= Add the following character to CList
-     *   = Add to ht: key a1a2, CList
-     *   = Repeat with next two characters in string a2a3
-     *   = Continue until one of the characters is '\0'.
-     *   = GO to next string in SList
+typedef struct MShard MShard; // A run of words counted by one thread
+
+struct MShard {
+    MHTable *ht;            // Table the shard is counted into
+    SList *words;           // First word of the shard
+    int n;                  // Words in the shard
+};
+
+static void* markov_shard_worker(void *arg) {
+    MShard *sh = arg;
+    SList *sit = sh->words;
+    int i = 0;
+    for(i = 0; i < sh->n; i++) {
+        markov_count_word(sh->ht, sit->data);
+        sit = sit->next;
+    }
+    return NULL;
+}
+
+MHTable* markov_generate_mht(SList *words, int order, int nthreads) {
+    /* Single pass trainer. Each word in SList (words) is walked once, and
+     * every (key -> next character) transition is counted straight into the
+     * hash table, for every key length from 1 up to order:
+     * - Take the k characters starting at i (a1a2a3, "key")
+     * - The character after the key is the next character (a4), or '\0' if
+     *   the key ends the word
+     * - Add one to the count of the next character in the key's row
+     * - Repeat with i + 1 until the key runs off the end of the word
+     * - Count the first key of the word as a starter key
+     * Keeping the shorter keys lets generation back off to them when a long
+     * key is missing or has only been seen a few times.
+     *
+     * With nthreads > 1 the list is cut into that many shards, each counted
+     * into its own table on its own thread, and the tables are merged. Counts
+     * just add up, and mht_finalize lays the table out from the counts alone,
+     * so the model is the same byte for byte whatever nthreads is.
      */
 
-    MHTable *ht = create_mhtable(CAPACITY);
+    MShard *shards = NULL;
+    pthread_t *threads = NULL;
+    bool *started = NULL;
+    MHTable *ht = NULL;
     SList *sit = NULL;
+    int nwords = slist_count(words);
     int i = 0;
     int j = 0;
-    char key[KEYSZ+1];
-    key[KEYSZ] = '\0';
 
-    // Loop through SList
+    if(nthreads > nwords) nthreads = nwords;
+    if(nthreads < 1) nthreads = 1;
+    shards = calloc(nthreads, sizeof(MShard));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    started = calloc(nthreads, sizeof(bool));
     sit = words;
-    slist_to_lower(words);
-    i = 0;
-    j = 0;
-    while(sit) {
-        if(strlen(sit->data) < KEYSZ) {
+    for(i = 0; i < nthreads; i++) {
+        shards[i].ht = create_mhtable(CAPACITY, order);
+        shards[i].words = sit;
+        shards[i].n = nwords / nthreads + ((i < nwords % nthreads) ? 1 : 0);
+        for(j = 0; j < shards[i].n; j++) {
             sit = sit->next;
-            continue;
         }
-        for(i = 0; i < strlen(sit->data); i++)
-        {
-            for(j = 0; j < KEYSZ; j++) {
-                key[j] = sit->data[i+j];
+    }
+
+    // Shard 0 is counted on this thread, as is any shard whose thread fails
+    for(i = 1; i < nthreads; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, 
+                    markov_shard_worker, &shards[i]) == 0);
+    }
+    markov_shard_worker(&shards[0]);
+    ht = shards[0].ht;
+    for(i = 1; i < nthreads; i++) {
+        if(started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            markov_shard_worker(&shards[i]);
+        }
+        mht_merge(ht, shards[i].ht);
+        destroy_mhtable(shards[i].ht);
+    }
+    free(shards);
+    free(threads);
+    free(started);
+
+    mht_finalize(ht);
+    return ht;
+}
+
+int markov_count_word(MHTable *ht, char *word) {
+    /* Count every transition in a single word into the hash table, record the
+     * word's first key (up to ht->order long) as a starter key, and keep track
+     * of the longest and shortest word. The word is lowercased and turned
+     * into symbols in place first (see markov_utf8.c), and lengths are in
+     * characters. A word with more distinct characters than the table has
+     * symbols left for is skipped. Returns the length counted, 0 if none. */
+    int len = markov_encode_word(ht, word, true);
+    int i = 0;
+    int k = 0;
+    char key[KEYMAX+1];
+
+    if(len <= 0) return 0;
+    if(len > ht->wmax) {
+        ht->wmax = len;
+    }
+    if(!ht->wmin || (len < ht->wmin)) {
+        ht->wmin = len;
+    }
+    ht->lens[(len < NAMEMAX) ? len : NAMEMAX - 1] += 1;
+    for(i = 0; i < len; i++) {
+        for(k = 1; (k <= ht->order) && (i + k <= len); k++) {
+            memcpy(key, word + i, k);
+            key[k] = '\0';
+            mht_insert(ht, key, word[i + k]);
+        }
+    }
+
+    // Starter keys are counted on their node, so each one is kept once
+    k = (len < ht->order) ? len : ht->order;
+    memcpy(key, word, k);
+    key[k] = '\0';
+    mht_insert_node(ht, key)->starts += 1;
+    return len;
+}
+
+/*****
+ * Incremental training
+ *
+ * markov_add_words and markov_remove_words change a model in place. Only the
+ * keys of the words given are touched: their counts change, and afterwards
+ * their alias rows are rebuilt and their start counts patched in the starts
+ * array. The starts array is only rebuilt from the whole table when a key
+ * starts or stops being a starter key, or the slots move (the table grew or a
+ * key was deleted). A finalized or loaded model is thawed first, which copies
+ * it once; mht_finalize compacts it again before it is saved.
+ *****/
+typedef struct MTouched MTouched; // Keys whose counts changed
+
+struct MTouched {
+    char (*keys)[KEYMAX + 1];
+    int n;
+    int cap;
+};
+
+static void markov_touch_word(MTouched *t, char *word, int order) {
+    // Remember every key of word
+    int len = strlen(word);
+    int i = 0;
+    int k = 0;
+    for(i = 0; i < len; i++) {
+        for(k = 1; (k <= order) && (i + k <= len); k++) {
+            if(t->n == t->cap) {
+                t->cap = t->cap ? t->cap * 2 : 256;
+                t->keys = realloc(t->keys, sizeof(*t->keys) * t->cap);
             }
-            if(key[KEYSZ-1] == '\0') break;
-            mht_insert(ht, key, markov_find_match(key, words));
+            memcpy(t->keys[t->n], word + i, k);
+            t->keys[t->n][k] = '\0';
+            t->n += 1;
         }
-        // Add first KEYSZ letters of word to starter key list
-        for(j = 0; j < KEYSZ; j++) {
-            key[j] = sit->data[j];
+    }
+}
+
+static int markov_cmp_start(const void *a, const void *b) {
+    return ((MStart*)a)->slot - ((MStart*)b)->slot;
+}
+
+static void markov_rebuild_starts(MHTable *ht) {
+    // Collect every key with a start count into the starts array again
+    int i = 0;
+    free(ht->starts);
+    ht->nstarts = 0;
+    for(i = 0; i < ht->size; i++) {
+        if(ht->items[i].key[0] && ht->items[i].starts) ht->nstarts++;
+    }
+    ht->starts = malloc(sizeof(MStart) * (ht->nstarts ? ht->nstarts : 1));
+    ht->nstarts = 0;
+    for(i = 0; i < ht->size; i++) {
+        if(ht->items[i].key[0] && ht->items[i].starts) {
+            ht->starts[ht->nstarts].slot = i;
+            ht->starts[ht->nstarts].count = ht->items[i].starts;
+            ht->nstarts += 1;
         }
-        if(!(ht->stkeys)) {
-            ht->stkeys = create_slist(key);
-        } else {
-            slist_push(&(ht->stkeys),key);
+    }
+}
+
+static void markov_refresh(MHTable *ht, MTouched *t, bool moved) {
+    /* Rebuild the alias rows of the touched keys and bring the starts array
+     * up to date. Starts are sorted by slot, so a touched starter key is
+     * found by binary search. */
+    MHTNode *node = NULL;
+    MStart *st = NULL;
+    MStart find;
+    int i = 0;
+
+    for(i = 0; i < t->n; i++) {
+        node = mht_search_node(ht, t->keys[i]);
+        if(!node) continue;
+        mhtnode_build_alias(ht, node);
+        if(moved) continue;
+        find.slot = node - ht->items;
+        st = bsearch(&find, ht->starts, ht->nstarts, sizeof(MStart),
+                markov_cmp_start);
+        if(st && node->starts) {
+            st->count = node->starts;
+        } else if(st || node->starts) {
+            // Joined or left the starter keys
+            moved = true;
         }
-        sit = sit->next;
     }
+    if(moved) {
+        markov_rebuild_starts(ht);
+    }
+    mht_build_start_alias(ht);
+    free(t->keys);
+}
 
-    // Set maximum/minimum word length
-    ht->wmax = slist_get_max(words);
-    ht->wmin = slist_get_min(words);
-    
-    return ht;
+static void markov_word_lengths(MHTable *ht) {
+    // Shortest and longest word from the length counts
+    int i = 0;
+    ht->wmin = 0;
+    for(i = 1; (i < NAMEMAX) && !ht->wmin; i++) {
+        if(ht->lens[i]) ht->wmin = i;
+    }
+    if(!ht->lens[NAMEMAX - 1]) {
+        // (Past NAMEMAX the exact length is unknown, but is never used)
+        ht->wmax = 0;
+        for(i = NAMEMAX - 2; (i > 0) && !ht->wmax; i--) {
+            if(ht->lens[i]) ht->wmax = i;
+        }
+    }
 }
 
-char markov_find_key_str(char *str, char *key) {
-    char result = '\0';
+int markov_add_words(MHTable *ht, SList *words) {
+    /* Count every word into an existing model. Words are lowercased and
+     * turned into symbols in place. Returns the number of words added. */
+    MTouched t = {NULL, 0, 0};
+    int size = 0;
+    int n = 0;
+
+    mht_thaw(ht);
+    size = ht->size;
+    for(; words; words = words->next) {
+        if(!markov_count_word(ht, words->data)) continue;
+        markov_touch_word(&t, words->data, ht->order);
+        n++;
+    }
+    markov_refresh(ht, &t, ht->size != size);
+    return n;
+}
+
+static bool markov_has_word(MHTable *ht, char *word) {
+    /* Check every count word would take away is there. It can't prove the
+     * word was added, but keeps counts from going below zero. */
+    MHTNode *node = NULL;
+    MFollower *f = NULL;
+    int len = strlen(word);
     int i = 0;
     int j = 0;
-    char buf[KEYSZ+1];
-    buf[KEYSZ] = '\0';
-    for(i = 0; i < strlen(str)-KEYSZ+1; i++) {
-        for(j = 0; j < KEYSZ; j++) {
-            buf[j] = str[i+j];
+    int k = 0;
+    char key[KEYMAX+1];
+
+    if(!ht->lens[(len < NAMEMAX) ? len : NAMEMAX - 1]) return false;
+    for(i = 0; i < len; i++) {
+        for(k = 1; (k <= ht->order) && (i + k <= len); k++) {
+            memcpy(key, word + i, k);
+            key[k] = '\0';
+            node = mht_search_node(ht, key);
+            if(!node) return false;
+            f = ht->follows + node->first;
+            for(j = 0; (j < node->nnexts) && (f[j].ch != word[i + k]); j++);
+            if((j == node->nnexts) || !f[j].count) return false;
+            if((i == 0) && (i + k == ((len < ht->order) ? len : ht->order)) &&
+                    !node->starts) {
+                return false;
+            }
         }
-        if(strcmp(buf,key) == 0) {
-            result = str[i+KEYSZ];
-            if(!result) {
-                result = '!';
+    }
+    return true;
+}
+
+int markov_remove_words(MHTable *ht, SList *words) {
+    /* Take the counts of every word back out of a model. Words are lowercased
+     * and turned into symbols in place, and words the model doesn't have are
+     * skipped. Keys left with
+     * no counts are deleted. Returns the number of words removed. */
+    MTouched t = {NULL, 0, 0};
+    MHTNode *node = NULL;
+    MFollower *f = NULL;
+    bool moved = false;
+    char *word = NULL;
+    char key[KEYMAX+1];
+    int len = 0;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+    int n = 0;
+
+    mht_thaw(ht);
+    for(; words; words = words->next) {
+        word = words->data;
+        if((markov_encode_word(ht, word, false) <= 0) ||
+                !markov_has_word(ht, word)) {
+            continue;
+        }
+        len = strlen(word);
+        ht->lens[(len < NAMEMAX) ? len : NAMEMAX - 1] -= 1;
+        for(i = 0; i < len; i++) {
+            for(k = 1; (k <= ht->order) && (i + k <= len); k++) {
+                memcpy(key, word + i, k);
+                key[k] = '\0';
+                node = mht_search_node(ht, key);
+                if(!node) continue;
+                if((i == 0) && (k == ((len < ht->order) ? len : ht->order)) &&
+                        node->starts) {
+                    node->starts -= 1;
+                }
+                f = ht->follows + node->first;
+                for(j = 0; (j < node->nnexts) && (f[j].ch != word[i + k]); j++);
+                if((j == node->nnexts) || !f[j].count) continue;
+                f[j].count -= 1;
+                node->nvalues -= 1;
+                if(!f[j].count) {
+                    // Drop the follower, the row is sorted again by its rebuild
+                    f[j] = f[node->nnexts - 1];
+                    node->nnexts -= 1;
+                }
+                if(!node->nvalues) {
+                    mht_delete(ht, key);
+                    moved = true;
+                }
             }
-            break;
         }
+        markov_touch_word(&t, word, ht->order);
+        n++;
     }
-    return result;
+    markov_word_lengths(ht);
+    markov_refresh(ht, &t, moved);
+    return n;
+}
+
+MHTNode* markov_backoff_node(MHTable *ht, char *name, int n, int d) {
+    /* Find the node to continue a (lowercase) name of n characters from. The
+     * longest key ending the name is tried first, backing off to shorter keys
+     * while the key is missing or seen fewer than ht->minobs times. If every
+     * key is sparse the longest one that exists is used. d is the packed key
+     * of the end of the name when the table is dense. */
+    MHTNode *node = NULL;
+    MHTNode *best = NULL;
+    char key[KEYMAX+1];
+    int k = (n < ht->order) ? n : ht->order;
+    int rows = 1;
+    int i = 0;
+
+    for(i = 0; ht->dense && (i < k); i++) {
+        rows *= DENSE_ALPHA;
+    }
+    for(; k > 0; k--) {
+        if(ht->dense) {
+            node = mht_dense_node(ht, d % rows);
+            rows /= DENSE_ALPHA;
+        } else {
+            memcpy(key, name + n - k, k);
+            key[k] = '\0';
+            node = mht_search_node(ht, key);
+        }
+        if(!node) continue;
+        if(node->nvalues >= ht->minobs) return node;
+        if(!best) best = node;
+    }
+    return best;
 }
 
 void string_to_lower(char *str) {
     int i = 0;
     for(i = 0; str[i]; i++) {
-        str[i] = tolower(str[i]);
+        str[i] = tolower((unsigned char)str[i]);
     }
 }
 
 void string_to_upper(char *str) {
     int i = 0;
     for(i = 0; str[i]; i++) {
-        str[i] = toupper(str[i]);
+        str[i] = toupper((unsigned char)str[i]);
     }
 }
 
@@ -132,124 +420,90 @@ void slist_to_upper(SList *words) {
     }
 }
 
-CList* markov_find_match(char *key, SList *words) {
-    CList *result = NULL;
-    SList *tmp = words;
-    char c;
-    // Look through SList for key, if found add the next character after the key
-    // to the CList
-    while(tmp) {
-        c = markov_find_key_str(tmp->data,key);
-        if(c) {
-            if(c == '!') c = '\0';
-            if (result) {
-                clist_push(&result,c);
-            } else {
-                result = create_clist_node(c);
-            }
-        }             
-        tmp = tmp->next;
-    }
-    return result;
-}
-
 /*****
  * Random name functions
  *****/
-MHTNode* mht_get_random_node(MHTable *ht) {
-    MHTNode *result = NULL;
-    int r = mt_rand(0,slist_count(ht->stkeys)-1);
+MHTNode* mht_get_random_node(MHTable *ht, Rng *rng) {
+    /* Pick the key a word starts with, weighted by how many words started
+     * with it, in constant time. NULL if the table has none. */
     int i = 0;
-    SList *key = ht->stkeys;
-    for(i = 0; i < r; i++) {
-        key = key->next;
-    }
-    if(key) {
-        result = mht_search_node(ht, key->data);
-    } else {
-        printf("Item %d not found in hash table keys! i = %d.\n", r,i);
-        slist_print(ht->keys,'\n');
+    if(!ht->nstarts) return NULL;
+    i = rng_below(rng, ht->nstarts);
+    if(rng_u32(rng) >= ht->starts[i].prob) {
+        i = ht->starts[i].alias;
     }
-
-    return result;
+    return &(ht->items[ht->starts[i].slot]);
 }
 
-char clist_get_random(CList *cl, int n) {
-    char result = '\0';
-    if(!n) return result;
-    int i = mt_rand(0, n-1);
-    int j = 0;
-    CList *tmp = cl;
-    for(j = 0; j < i; j++) {
-        tmp = tmp->next;
-    }
-    if(tmp) {
-        result = tmp->ch;
-    }
-    
-    return result;
-}
-
-SList* generate_random_word(MHTable *ht,char *outf) {
+int markov_generate_name(MHTable *ht, Rng *rng, char *name, int cap) {
     /* Need to:
      * - Choose random element from table to start name (key)
-     * - Choose random following character from that value CList
-     * - Look for next key made of key[1] and that character
-     * - Continue until name is a max length or there is no values in CList
+     * - Choose random following character from that node's followers
+     * - Find the node for the end of the name (see markov_backoff_node)
+     * - Continue until name is a max length or the word end is chosen
+     * The name is written to name (cap bytes, including the '\0') and its
+     * length in bytes returned. A table with non-ASCII symbols generates into
+     * a symbol buffer first, which is then written out as UTF-8. Only ht is
+     * shared, so threads with their own rng can call this at the same time.
      */
-    SList *result = NULL;
-    char *name = malloc(sizeof(char) * 100);
-    memset(name, '\0', 100);
-    char key[KEYSZ + 1];
     char c;
+    char syms[NAMEMAX];
+    char *buf = ht->nsyms ? syms : name;
     int i = 0;
-    int j = 0;
-    int k = 0;
-    FILE *f = NULL;
-    int length = mt_rand(ht->wmin, ht->wmax);
-    length = ht->wmax;
-    MHTNode *tmp = mht_get_random_node(ht);
-    for(i = 0; i < KEYSZ; i++) {
-        key[i] = tmp->key[i];
-        name[i] = key[i];
-    }
-    key[KEYSZ] = '\0';
-    name[KEYSZ] = '\0';
-    name[0] = toupper(name[0]);
+    int d = -1;
+    int first = 0;
+    int length = ht->nsyms ? NAMEMAX - 1 : cap - 1;
+    MHTNode *tmp = mht_get_random_node(ht, rng);
+
+    if(ht->wmax < length) length = ht->wmax;
+    buf[0] = '\0';
+    if(tmp) {
+        strncpy(buf, tmp->key, length);
+        buf[length] = '\0';
+    }
+    if(ht->dense) {
+        d = dense_index(buf, ht->order);
+    }
     
-    for(i = KEYSZ; i < length; i++) {
+    first = strlen(buf);
+    for(i = first; i < length; i++) {
         if(!tmp) {
-            name[i] = '\0';
             break;
         }
-        c = clist_get_random(tmp->values, tmp->nvalues);
+        c = mhtnode_get_random(ht, tmp, rng);
         if(!c) {
-           name[i] = '\0';
            break; 
         }
-        name[i] = c;
-        /* Leaving this here so future Zach won't look at that loop below like
-         * it's some sort of dark black magic.
-         * KEYSZ = 3
-         * k = KEYSZ - 1 - j
-         * key[0] = name[i-2] | j=0 k=2
-         * key[1] = name[i-1] | j=1 k=1
-         * key[2] = name[i]   | j=2 k=0
-         */
-        for(j = 0; j < KEYSZ; j++) {
-            k = KEYSZ - 1 - j;
-            key[j] = name[i-k];
-        } 
-        tmp = ht->items[mht_hash(key)];
-    }
-    if(outf) {
-        f = fopen(outf, "a+");
-        fprintf(f,"%s\n",name);
-        fclose(f);
+        buf[i] = c;
+        if(ht->dense) {
+            // Roll the packed key forward, no key string or hashing needed
+            d = dense_next(d, c, ht->drows);
+        }
+        tmp = markov_backoff_node(ht, buf, i + 1, d);
+    }
+    if(markov_metrics_on) {
+        mmetrics_name(i - first, !tmp && (i < length));
+    }
+    if(ht->nsyms) {
+        return markov_decode_name(ht, syms, i, name, cap, true);
+    }
+    name[i] = '\0';
+    name[0] = toupper(name[0]);
+    return i;
+}
+
+SList* generate_random_word(MHTable *ht, Rng *rng, MSink *out) {
+    /* Generate one name, and either write it to out or return it as a
+     * single SList node */
+    SList *result = NULL;
+    char name[NAMEMAX];
+
+    markov_generate_name(ht, rng, name, NAMEMAX);
+    if(out) {
+        msink_puts(out, name, '\n');
     } else {
         //printf("%s ",name);
         result = create_slist(name);
     }
-    free(name);
     return(result);
 }
@@ -0,0 +1,257 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <signal.h>
+#include <time.h>
+
+/*****
+ * Metrics
+ *
+ * Each thread records into its own MMetrics, found through a thread local
+ * pointer, so recording takes no lock and shares no cache lines. Every field
+ * has one writer, which stores with relaxed atomics so a dump can read it
+ * while the thread carries on. A thread's metrics are folded into the
+ * retired totals when it exits. Latencies go into log-linear histograms
+ * (HdrHistogram style): HIST_SUB buckets per power of two, so any value is
+ * within 1/HIST_SUB of its bucket.
+ *****/
+bool markov_metrics_on = false;
+
+static MMetrics *met_live = NULL;       // Every running thread's metrics
+static MMetrics met_retired;            // Totals of threads that have exited
+static pthread_mutex_t met_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t met_key;
+static __thread MMetrics *met_self = NULL;
+static char *met_fname = NULL;          // Dump file, NULL for stderr
+static uint64_t met_start = 0;          // When metrics were enabled
+static const char *met_names[] = {"train", "generate", "write", "request"};
+
+uint64_t mmetrics_now(void) {
+    // Monotonic clock in nanoseconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void met_add(uint64_t *p, uint64_t v) {
+    // Only the owning thread writes p, readers may be on other threads
+    __atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t met_get(uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static int hist_index(uint64_t v) {
+    // Values below HIST_SUB get a bucket each, above that HIST_SUB a doubling
+    int shift = 0;
+    if(v < HIST_SUB) return (int)v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUBBITS;
+    return shift * HIST_SUB + (int)(v >> shift);
+}
+
+static uint64_t hist_value(int i) {
+    // Middle of bucket i
+    int shift = 0;
+    if(i < 2 * HIST_SUB) return i;
+    shift = i / HIST_SUB - 1;
+    return ((uint64_t)(i - shift * HIST_SUB) << shift) +
+        ((1ULL << shift) >> 1);
+}
+
+static void hist_record(MHist *h, uint64_t v) {
+    met_add(&(h->buckets[hist_index(v)]), 1);
+    met_add(&(h->count), 1);
+    met_add(&(h->sum), v);
+    if(v > h->max) __atomic_store_n(&(h->max), v, __ATOMIC_RELAXED);
+    if(!h->min || (v < h->min)) __atomic_store_n(&(h->min), v, __ATOMIC_RELAXED);
+}
+
+static void hist_merge(MHist *to, MHist *from) {
+    // Add from into to (to is private to the caller)
+    uint64_t min = met_get(&(from->min));
+    uint64_t max = met_get(&(from->max));
+    int i = 0;
+    for(i = 0; i < HIST_BUCKETS; i++) {
+        to->buckets[i] += met_get(&(from->buckets[i]));
+    }
+    to->count += met_get(&(from->count));
+    to->sum += met_get(&(from->sum));
+    if(max > to->max) to->max = max;
+    if(min && (!to->min || (min < to->min))) to->min = min;
+}
+
+static uint64_t hist_percentile(MHist *h, double q) {
+    /* Value below which a fraction q of the recorded values fall. Buckets
+     * only give a range, so the result is kept within what was recorded. */
+    uint64_t want = (uint64_t)(q * h->count);
+    uint64_t seen = 0;
+    uint64_t v = 0;
+    int i = 0;
+    if(want >= h->count) want = h->count - 1;
+    for(i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen > want) break;
+    }
+    v = hist_value(i);
+    if(v > h->max) v = h->max;
+    if(v < h->min) v = h->min;
+    return v;
+}
+
+static void metrics_merge(MMetrics *to, MMetrics *from) {
+    int i = 0;
+    for(i = 0; i < MET_NHISTS; i++) {
+        hist_merge(&(to->hists[i]), &(from->hists[i]));
+    }
+    to->names += met_get(&(from->names));
+    to->steps += met_get(&(from->steps));
+    to->deadends += met_get(&(from->deadends));
+    to->retries += met_get(&(from->retries));
+    to->bytes += met_get(&(from->bytes));
+}
+
+static void metrics_retire(void *arg) {
+    /* Thread exit: fold the thread's metrics into the retired totals */
+    MMetrics *m = arg;
+    MMetrics **p = NULL;
+    pthread_mutex_lock(&met_lock);
+    for(p = &met_live; *p && (*p != m); p = &((*p)->next));
+    if(*p) *p = m->next;
+    metrics_merge(&met_retired, m);
+    pthread_mutex_unlock(&met_lock);
+    free(m);
+}
+
+MMetrics* mmetrics_self(void) {
+    /* This thread's metrics, made on first use */
+    if(met_self) return met_self;
+    met_self = calloc(1, sizeof(MMetrics));
+    pthread_mutex_lock(&met_lock);
+    met_self->next = met_live;
+    met_live = met_self;
+    pthread_mutex_unlock(&met_lock);
+    pthread_setspecific(met_key, met_self);
+    return met_self;
+}
+
+void mmetrics_record(MetHist h, uint64_t start) {
+    // Record the time since start (from mmetrics_now)
+    hist_record(&(mmetrics_self()->hists[h]), mmetrics_now() - start);
+}
+
+void mmetrics_name(int steps, bool deadend) {
+    // One name generated, with steps characters drawn along the chain
+    MMetrics *m = mmetrics_self();
+    met_add(&(m->names), 1);
+    met_add(&(m->steps), steps);
+    if(deadend) met_add(&(m->deadends), 1);
+}
+
+void mmetrics_count(uint64_t *counter, uint64_t n) {
+    // Add to one of this thread's counters
+    met_add(counter, n);
+}
+
+void mmetrics_dump(void) {
+    /* Write the totals so far, over every thread, as one JSON object: each
+     * histogram's count, mean and percentiles in nanoseconds, and the
+     * counters with rates over the time since metrics were enabled */
+    MMetrics *all = calloc(1, sizeof(MMetrics));
+    MMetrics *m = NULL;
+    MHist *h = NULL;
+    FILE *f = met_fname ? fopen(met_fname, "a") : stderr;
+    double secs = (mmetrics_now() - met_start) / 1e9;
+    int i = 0;
+
+    if(!f) {
+        free(all);
+        return;
+    }
+    pthread_mutex_lock(&met_lock);
+    metrics_merge(all, &met_retired);
+    for(m = met_live; m; m = m->next) {
+        metrics_merge(all, m);
+    }
+    pthread_mutex_unlock(&met_lock);
+
+    fprintf(f, "{\"elapsed_s\": %.3f,\n", secs);
+    for(i = 0; i < MET_NHISTS; i++) {
+        h = &(all->hists[i]);
+        fprintf(f, " \"%s_ns\": {\"count\": %lu", met_names[i],
+                (unsigned long)h->count);
+        if(h->count) {
+            fprintf(f, ", \"min\": %lu, \"mean\": %.0f, \"p50\": %lu, "
+                    "\"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu",
+                    (unsigned long)h->min, (double)h->sum / h->count,
+                    (unsigned long)hist_percentile(h, 0.5),
+                    (unsigned long)hist_percentile(h, 0.9),
+                    (unsigned long)hist_percentile(h, 0.99),
+                    (unsigned long)hist_percentile(h, 0.999),
+                    (unsigned long)h->max);
+        }
+        fprintf(f, "},\n");
+    }
+    fprintf(f, " \"names\": %lu, \"names_per_s\": %.0f, \"chain_steps\": %lu, "
+            "\"dead_ends\": %lu, \"retries\": %lu, \"bytes_written\": %lu}\n",
+            (unsigned long)all->names, (secs > 0) ? all->names / secs : 0,
+            (unsigned long)all->steps, (unsigned long)all->deadends,
+            (unsigned long)all->retries, (unsigned long)all->bytes);
+    if(f == stderr) {
+        fflush(f);
+    } else {
+        fclose(f);
+    }
+    free(all);
+}
+
+static void* metrics_signal_thread(void *arg) {
+    /* Dump whenever SIGUSR1 arrives. The signal is blocked everywhere and
+     * taken here with sigwait, so the dump runs as ordinary code. */
+    sigset_t *set = arg;
+    int sig = 0;
+    while(sigwait(set, &sig) == 0) {
+        mmetrics_dump();
+    }
+    return NULL;
+}
+
+int mmetrics_enable(char *fname) {
+    /* Start recording, with dumps going to fname (appended, "-" for stderr).
+     * Must be called before any other thread is started, since it blocks
+     * SIGUSR1 for this thread and every thread it starts afterwards.
+     * Returns -1 if the dump thread couldn't be started (metrics are still
+     * recorded and dumped at exit). */
+    static sigset_t set;
+    pthread_t thread;
+
+    met_fname = strcmp(fname, "-") ? strdup(fname) : NULL;
+    met_start = mmetrics_now();
+    pthread_key_create(&met_key, metrics_retire);
+    markov_metrics_on = true;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if(pthread_create(&thread, NULL, metrics_signal_thread, &set) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
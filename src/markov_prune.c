@@ -0,0 +1,291 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <math.h>
+
+/*****
+ * Pruning and quantization
+ *
+ * Both are passes over a finished model, for when it has to fit in less
+ * memory. mht_prune drops every transition seen fewer than mincount times,
+ * and every context left with nothing (generation backs off past it, as it
+ * would past any key it never saw). Single character rows are left alone, so
+ * there is always a row to back off to. mht_quantize keeps only the alias table
+ * of each row, its thresholds cut from 32 to 8 or 16 bits, as a 3 or 4 byte
+ * follower in place of the 12 byte MFollower. The counts are gone after
+ * that: a quantized model given more words starts from counts rebuilt from
+ * its probabilities. mht_drift measures what either pass did to the next
+ * character distributions.
+ *****/
+void mhtnode_probs(MHTable *ht, MHTNode *node, double *p) {
+    /* The chance of each follower of node being drawn. For a quantized row
+     * that is whatever its alias table gives: column i is picked 1 in nnexts
+     * times, kept with its threshold, and otherwise hands over to its alias. */
+    MFollower8 *f8 = NULL;
+    MFollower16 *f16 = NULL;
+    double keep = 0;
+    int alias = 0;
+    int i = 0;
+
+    if(!ht->qfollows) {
+        for(i = 0; i < node->nnexts; i++) {
+            p[i] = (double)ht->follows[node->first + i].count / node->nvalues;
+        }
+        return;
+    }
+    if(ht->qbits == 8) {
+        f8 = (MFollower8*)ht->qfollows + node->first;
+    } else {
+        f16 = (MFollower16*)ht->qfollows + node->first;
+    }
+    for(i = 0; i < node->nnexts; i++) {
+        p[i] = 0;
+    }
+    for(i = 0; i < node->nnexts; i++) {
+        keep = f8 ? f8[i].prob / 256.0 : f16[i].prob / 65536.0;
+        alias = f8 ? f8[i].alias : f16[i].alias;
+        p[i] += keep / node->nnexts;
+        p[alias] += (1 - keep) / node->nnexts;
+    }
+}
+
+void mht_quantize_rows(MHTable *ht, void *out) {
+    /* Write every row of ht->follows (alias tables built) to out in the
+     * ht->qbits format. Thresholds are rounded to the nearest step; a full
+     * column (2^32 - 1) becomes the largest one, and is its own alias. */
+    MFollower8 *f8 = out;
+    MFollower16 *f16 = out;
+    MFollower *f = NULL;
+    int shift = 32 - ht->qbits;
+    uint64_t top = (1ULL << ht->qbits) - 1;
+    uint64_t q = 0;
+    int i = 0;
+
+    for(i = 0; i < ht->nfollows; i++) {
+        f = &(ht->follows[i]);
+        q = ((uint64_t)f->prob + (1ULL << (shift - 1))) >> shift;
+        if(q > top) q = top;
+        if(ht->qbits == 8) {
+            f8[i].prob = q;
+            f8[i].alias = f->alias;
+            f8[i].ch = f->ch;
+        } else {
+            f16[i].prob = q;
+            f16[i].alias = f->alias;
+            f16[i].ch = f->ch;
+        }
+    }
+}
+
+void mht_dequantize_rows(MHTable *ht, MFollower *follows) {
+    /* Counts for every quantized row, written to follows in the same places:
+     * each follower gets its share of the node's count (at least 1), and the
+     * node's count becomes their sum. */
+    MHTNode *node = NULL;
+    double p[256];
+    unsigned int count = 0;
+    int i = 0;
+    int j = 0;
+
+    for(i = 0; i < ht->size; i++) {
+        node = &(ht->items[i]);
+        if(!node->key[0]) continue;
+        mhtnode_probs(ht, node, p);
+        count = node->nvalues;
+        node->nvalues = 0;
+        for(j = 0; j < node->nnexts; j++) {
+            follows[node->first + j].count = llround(p[j] * count);
+            if(!follows[node->first + j].count) {
+                follows[node->first + j].count = 1;
+            }
+            follows[node->first + j].ch = mht_follow_ch(ht, node->first + j);
+            node->nvalues += follows[node->first + j].count;
+        }
+    }
+}
+
+static bool mht_prune_keeps(MHTable *ht, MHTNode *node, unsigned int mincount) {
+    /* Whether pruning leaves node anything. Rows of single characters are
+     * never pruned, so generation can always back off to one. */
+    MFollower *f = ht->follows + node->first;
+    int j = 0;
+    if(!node->key[1]) return true;
+    for(j = 0; j < node->nnexts; j++) {
+        if(f[j].count >= mincount) return true;
+    }
+    return false;
+}
+
+int mht_prune(MHTable *ht, unsigned int mincount) {
+    /* Drop the transitions seen fewer than mincount times, then the contexts
+     * left with none, and the starts seen fewer than mincount times (unless
+     * that would leave none of those). Rows of single characters are kept
+     * whole. The table is finalized again. Returns the number of transitions
+     * dropped, or -1, leaving the model as it was, if no start would be left
+     * to begin a name with. */
+    MHTNode *node = NULL;
+    MFollower *f = NULL;
+    bool starts = false;
+    int kept = 0;
+    int dropped = 0;
+    int i = 0;
+    int j = 0;
+
+    mht_thaw(ht);
+    for(i = 0; i < ht->size; i++) {
+        node = &(ht->items[i]);
+        if(!node->key[0] || !node->starts) continue;
+        if(mht_prune_keeps(ht, node, mincount)) kept += 1;
+    }
+    if(!kept) {
+        mht_finalize(ht);
+        return -1;
+    }
+
+    for(i = 0; i < ht->size; i++) {
+        node = &(ht->items[i]);
+        if(!node->key[0] || !node->key[1]) continue;
+        f = ht->follows + node->first;
+        for(j = 0; j < node->nnexts; ) {
+            if(f[j].count >= mincount) {
+                j++;
+                continue;
+            }
+            // The row is sorted again when mht_finalize rebuilds it
+            node->nvalues -= f[j].count;
+            f[j] = f[node->nnexts - 1];
+            node->nnexts -= 1;
+            dropped += 1;
+        }
+        if(!node->nnexts) {
+            // Nothing is looked up until mht_finalize reinserts every key
+            node->key[0] = '\0';
+            ht->count -= 1;
+        }
+    }
+    for(i = 0; i < ht->size; i++) {
+        node = &(ht->items[i]);
+        if(node->key[0] && ((unsigned int)node->starts >= mincount)) {
+            starts = true;
+        }
+    }
+    for(i = 0; starts && (i < ht->size); i++) {
+        node = &(ht->items[i]);
+        if(node->key[0] && ((unsigned int)node->starts < mincount)) {
+            node->starts = 0;
+        }
+    }
+    mht_finalize(ht);
+    return dropped;
+}
+
+void mht_quantize(MHTable *ht, int bits) {
+    /* Quantize the rows to bits (8 or 16) bits, or with 0 go back to counts.
+     * Rows already quantized to other bits are thawed to counts first. */
+    if(ht->qfollows && (ht->qbits != bits)) {
+        mht_thaw(ht);
+    }
+    ht->qbits = bits;
+    mht_finalize(ht);
+}
+
+void mht_drift(MHTable *from, MHTable *to, MDrift *d) {
+    /* Compare the next character distribution of every context of from with
+     * the one to uses for it: its own row, or the row it backs off to if the
+     * key is gone. Each context is weighted by its count in from. tv is the
+     * total variation, and dropped the chance from gave to characters to no
+     * longer has. kl is the KL divergence in bits of the to row from the from
+     * row cut down to the characters to still has (and renormalized), so it
+     * is never negative; what was cut away is counted in dropped instead. */
+    MHTNode *a = NULL;
+    MHTNode *b = NULL;
+    double pa[256];
+    double pb[256];
+    double qb = 0;
+    double tv = 0;
+    double kl = 0;
+    double gone = 0;
+    double w = 0;
+    char ca = 0;
+    char cb = 0;
+    int len = 0;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    memset(d, 0, sizeof(MDrift));
+    for(i = 0; i < from->size; i++) {
+        a = &(from->items[i]);
+        if(!a->key[0] || !a->nvalues) continue;
+        w = a->nvalues;
+        len = strlen(a->key);
+        b = mht_search_node(to, a->key);
+        if(!b) {
+            d->backoff += w;
+            b = markov_backoff_node(to, a->key, len,
+                    to->dense ? dense_index(a->key, to->order) : -1);
+        }
+        mhtnode_probs(from, a, pa);
+        if(b) mhtnode_probs(to, b, pb);
+        // Both rows are sorted by character, so walk them together
+        tv = 0;
+        kl = 0;
+        gone = 0;
+        k = 0;
+        for(j = 0; j < a->nnexts; j++) {
+            ca = mht_follow_ch(from, a->first + j);
+            qb = 0;
+            for(; b && (k < b->nnexts); k++) {
+                cb = mht_follow_ch(to, b->first + k);
+                if((unsigned char)cb >= (unsigned char)ca) break;
+                tv += pb[k];
+            }
+            if(b && (k < b->nnexts) && (cb == ca)) {
+                qb = pb[k++];
+            }
+            tv += fabs(pa[j] - qb);
+            if(qb > 0) {
+                kl += pa[j] * log2(pa[j] / qb);
+            } else {
+                gone += pa[j];
+            }
+        }
+        for(; b && (k < b->nnexts); k++) {
+            tv += pb[k];
+        }
+        if(gone < 1) {
+            // sum p/(1-gone) log2((p/(1-gone))/q) over what to kept
+            kl = kl / (1 - gone) - log2(1 - gone);
+            if(kl < 0) kl = 0; // Rounding
+        } else {
+            kl = 0;
+        }
+        d->tv += w * tv / 2;
+        d->kl += w * kl;
+        d->dropped += w * gone;
+        d->weight += w;
+    }
+    if(d->weight > 0) {
+        d->tv /= d->weight;
+        d->kl /= d->weight;
+        d->dropped /= d->weight;
+        d->backoff /= d->weight;
+    }
+}
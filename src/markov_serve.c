@@ -0,0 +1,460 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/*****
+ * Name server
+ *
+ * One thread runs the event loop: it accepts clients and waits for them to
+ * send something. Client sockets are registered EPOLLONESHOT, so a readable
+ * client is handed to exactly one worker, which reads and answers every
+ * complete line it has, then arms the socket again. Requests are lines:
+ *     GEN model n [seed]  ->  "OK n" and n names, one per line
+ *     LIST                ->  "OK n" and the n model names
+ * anything else gets "ERR message". Without a seed, each worker draws from
+ * its own rng; with one, the same request always gets the same names. A
+ * client that doesn't take its answer within SERVE_SNDTIMEO seconds is
+ * dropped, so it can't keep a worker to itself. A line longer than
+ * SERVE_LINEMAX - 1 gets "ERR line too long" and is thrown away. When the
+ * process runs out of descriptors the listening socket is taken out of the
+ * event loop until a client closes, rather than waking it over and over. SIGINT and SIGTERM are only
+ * let through while the event loop waits, so they land there.
+ *****/
+typedef struct MConn MConn;     // A connected client
+typedef struct MServer MServer; // Everything the threads share
+
+struct MConn {
+    int fd;
+    char line[SERVE_LINEMAX];   // Start of the request being read
+    int len;                    // Bytes in line
+    bool toolong;               // The line didn't fit, skip to its end
+};
+
+struct MServer {
+    MServeModel *models;
+    int nmodels;
+    int epfd;
+    int lfd;                    // Listening socket
+    bool paused;                // lfd is out of the loop, out of descriptors
+    MConn **queue;              // Ring of readable clients
+    int qcap;
+    int qhead;
+    int qcount;
+    bool stopping;
+    pthread_mutex_t lock;       // Guards the queue, stopping and paused
+    pthread_cond_t ready;       // Signalled when a client is queued
+};
+
+typedef struct MWorker MWorker; // One worker thread
+
+struct MWorker {
+    MServer *srv;
+    Rng rng;                    // For requests without a seed
+    char *out;                  // Response being built
+    size_t len;
+    size_t cap;
+};
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+static void serve_push(MServer *srv, MConn *conn) {
+    // Queue a readable client for the workers
+    int i = 0;
+    pthread_mutex_lock(&srv->lock);
+    if(srv->qcount == srv->qcap) {
+        // Grow the ring, unwrapping it into the new array
+        MConn **q = malloc(sizeof(MConn*) * srv->qcap * 2);
+        for(i = 0; i < srv->qcount; i++) {
+            q[i] = srv->queue[(srv->qhead + i) % srv->qcap];
+        }
+        free(srv->queue);
+        srv->queue = q;
+        srv->qhead = 0;
+        srv->qcap *= 2;
+    }
+    srv->queue[(srv->qhead + srv->qcount) % srv->qcap] = conn;
+    srv->qcount += 1;
+    pthread_cond_signal(&srv->ready);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static MConn* serve_pop(MServer *srv) {
+    // Next readable client, NULL once the server is stopping
+    MConn *conn = NULL;
+    pthread_mutex_lock(&srv->lock);
+    while(!srv->qcount && !srv->stopping) {
+        pthread_cond_wait(&srv->ready, &srv->lock);
+    }
+    if(srv->qcount) {
+        conn = srv->queue[srv->qhead];
+        srv->qhead = (srv->qhead + 1) % srv->qcap;
+        srv->qcount -= 1;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    return conn;
+}
+
+static void serve_reserve(MWorker *w, size_t n) {
+    if(w->len + n <= w->cap) return;
+    while(w->len + n > w->cap) {
+        w->cap *= 2;
+    }
+    w->out = realloc(w->out, w->cap);
+}
+
+static void serve_append(MWorker *w, const char *s) {
+    size_t n = strlen(s);
+    serve_reserve(w, n);
+    memcpy(w->out + w->len, s, n);
+    w->len += n;
+}
+
+static bool serve_flush(MWorker *w, int fd) {
+    /* Send the response built so far. False if the client has gone, or
+     * stopped reading (the send timed out). */
+    size_t off = 0;
+    ssize_t n = 0;
+    while(off < w->len) {
+        n = send(fd, w->out + off, w->len - off, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            w->len = 0;
+            return false;
+        }
+        off += n;
+    }
+    w->len = 0;
+    return true;
+}
+
+static MHTable* serve_find_model(MServer *srv, char *name) {
+    int i = 0;
+    for(i = 0; i < srv->nmodels; i++) {
+        if(strcmp(srv->models[i].name, name) == 0) {
+            return srv->models[i].ht;
+        }
+    }
+    return NULL;
+}
+
+static bool serve_request(MWorker *w, int fd, char *line) {
+    /* Answer one request line. False if the client has gone. */
+    MServer *srv = w->srv;
+    MHTable *ht = NULL;
+    Rng seeded;
+    Rng *rng = &w->rng;
+    char *cmd = NULL;
+    char *name = NULL;
+    char *count = NULL;
+    char *seed = NULL;
+    char *save = NULL;
+    char *end = NULL;
+    char *send = NULL;
+    char head[64];
+    uint64_t t = markov_metrics_on ? mmetrics_now() : 0;
+    unsigned long s = 0;
+    long n = 0;
+    int i = 0;
+
+    cmd = strtok_r(line, " \t\r", &save);
+    if(!cmd) return true;
+    if(strcmp(cmd, "LIST") == 0) {
+        snprintf(head, sizeof(head), "OK %d\n", srv->nmodels);
+        serve_append(w, head);
+        for(i = 0; i < srv->nmodels; i++) {
+            serve_append(w, srv->models[i].name);
+            serve_append(w, "\n");
+        }
+    } else if(strcmp(cmd, "GEN") == 0) {
+        name = strtok_r(NULL, " \t\r", &save);
+        count = strtok_r(NULL, " \t\r", &save);
+        seed = strtok_r(NULL, " \t\r", &save);
+        ht = name ? serve_find_model(srv, name) : NULL;
+        if(count) n = strtol(count, &end, 10);
+        if(seed) s = strtoul(seed, &send, 10);
+        if(!name || !count) {
+            serve_append(w, "ERR usage: GEN model n [seed]\n");
+        } else if(!ht) {
+            serve_append(w, "ERR unknown model\n");
+        } else if(*end || (n < 1) || (n > SERVE_MAXN)) {
+            serve_append(w, "ERR bad count\n");
+        } else if(seed && (*send || !isdigit((unsigned char)seed[0]))) {
+            serve_append(w, "ERR bad seed\n");
+        } else {
+            if(seed) {
+                rng_seed(&seeded, s, 0);
+                rng = &seeded;
+            }
+            snprintf(head, sizeof(head), "OK %ld\n", n);
+            serve_append(w, head);
+            for(i = 0; i < n; i++) {
+                serve_reserve(w, NAMEMAX + 1);
+                w->len += markov_generate_name(ht, rng, w->out + w->len,
+                        NAMEMAX);
+                w->out[w->len++] = '\n';
+                if(w->len >= SERVE_OUTSZ) {
+                    // Big answers go out in pieces
+                    if(!serve_flush(w, fd)) return false;
+                }
+            }
+        }
+    } else {
+        serve_append(w, "ERR unknown command\n");
+    }
+    if(!serve_flush(w, fd)) return false;
+    if(markov_metrics_on) mmetrics_record(MET_REQUEST, t);
+    return true;
+}
+
+static bool serve_read(MWorker *w, MConn *conn) {
+    /* Read whatever the client has sent and answer each complete line.
+     * False if the connection should be closed. */
+    char buf[4096];
+    ssize_t n = 0;
+    ssize_t i = 0;
+
+    while(true) {
+        n = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(n == 0) return false;
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        }
+        for(i = 0; i < n; i++) {
+            if((buf[i] == '\n') && conn->toolong) {
+                conn->len = 0;
+                conn->toolong = false;
+                serve_append(w, "ERR line too long\n");
+                if(!serve_flush(w, conn->fd)) return false;
+            } else if(buf[i] == '\n') {
+                conn->line[conn->len] = '\0';
+                conn->len = 0;
+                if(!serve_request(w, conn->fd, conn->line)) return false;
+            } else if(conn->len < SERVE_LINEMAX - 1) {
+                conn->line[conn->len++] = buf[i];
+            } else {
+                conn->toolong = true;
+            }
+        }
+    }
+}
+
+static void* serve_worker(void *arg) {
+    MWorker *w = arg;
+    MServer *srv = w->srv;
+    MConn *conn = NULL;
+    struct epoll_event ev;
+
+    while((conn = serve_pop(srv))) {
+        if(serve_read(w, conn)) {
+            // Wait for the next request
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.ptr = conn;
+            epoll_ctl(srv->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        } else {
+            // Closing the socket takes it out of the epoll set
+            close(conn->fd);
+            free(conn);
+            pthread_mutex_lock(&srv->lock);
+            if(srv->paused) {
+                // A descriptor is free again, take clients once more
+                srv->paused = false;
+                ev.events = EPOLLIN;
+                ev.data.ptr = NULL;
+                epoll_ctl(srv->epfd, EPOLL_CTL_MOD, srv->lfd, &ev);
+            }
+            pthread_mutex_unlock(&srv->lock);
+        }
+    }
+    return NULL;
+}
+
+static int serve_listen(char *path) {
+    // Listening socket bound to path, -1 on failure
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: \"%s\"\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+            (listen(fd, SOMAXCONN) < 0)) {
+        fprintf(stderr, "Unable to listen on \"%s\": %s\n", path,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int markov_serve(char *path, MServeModel *models, int nmodels, int nthreads) {
+    /* Serve names from models on the unix socket path with nthreads workers
+     * until SIGINT or SIGTERM. Returns 0, or -1 if the server couldn't start
+     * or its event loop failed. */
+    MServer srv;
+    MWorker *workers = NULL;
+    pthread_t *threads = NULL;
+    struct epoll_event ev;
+    struct epoll_event events[SERVE_EVENTS];
+    struct sigaction sa;
+    struct timeval tv;
+    sigset_t block;
+    sigset_t old;
+    MConn *conn = NULL;
+    unsigned long seed = time(NULL);
+    int lfd = serve_listen(path);
+    int started = 0;
+    int result = 0;
+    int cfd = -1;
+    int n = 0;
+    int i = 0;
+
+    if(lfd < 0) return -1;
+    if(nthreads < 1) nthreads = 1;
+    memset(&srv, 0, sizeof(srv));
+    srv.models = models;
+    srv.nmodels = nmodels;
+    srv.lfd = lfd;
+    srv.qcap = 64;
+    srv.queue = malloc(sizeof(MConn*) * srv.qcap);
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.ready, NULL);
+    srv.epfd = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // The listening socket
+    epoll_ctl(srv.epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // Workers inherit the blocked signals, the loop takes them in epoll_pwait
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    memset(&tv, 0, sizeof(tv));
+    tv.tv_sec = SERVE_SNDTIMEO;
+
+    workers = calloc(nthreads, sizeof(MWorker));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for(i = 0; i < nthreads; i++) {
+        workers[i].srv = &srv;
+        rng_seed(&workers[i].rng, seed, i);
+        workers[i].cap = SERVE_OUTSZ + NAMEMAX + 1;
+        workers[i].out = malloc(workers[i].cap);
+        if(pthread_create(&threads[i], NULL, serve_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Unable to start worker thread.\n");
+            break;
+        }
+        started++;
+    }
+    if(started) {
+        printf("Serving %d model%s on %s with %d worker%s\n", nmodels,
+                (nmodels == 1) ? "" : "s", path, started,
+                (started == 1) ? "" : "s");
+        fflush(stdout);
+    }
+
+    while(started && !serve_stop) {
+        n = epoll_pwait(srv.epfd, events, SERVE_EVENTS, -1, &old);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            perror("epoll_wait");
+            result = -1;
+            break;
+        }
+        for(i = 0; i < n; i++) {
+            if(events[i].data.ptr) {
+                serve_push(&srv, events[i].data.ptr);
+                continue;
+            }
+            cfd = accept(lfd, NULL, NULL);
+            if((cfd < 0) && ((errno == EMFILE) || (errno == ENFILE))) {
+                // Out of descriptors: stop listening until a client closes
+                // (see serve_worker). Try once more under the lock, in case
+                // one closed just now.
+                pthread_mutex_lock(&srv.lock);
+                cfd = accept(lfd, NULL, NULL);
+                if(cfd < 0) {
+                    srv.paused = true;
+                    ev.events = 0;
+                    ev.data.ptr = NULL;
+                    epoll_ctl(srv.epfd, EPOLL_CTL_MOD, lfd, &ev);
+                }
+                pthread_mutex_unlock(&srv.lock);
+            }
+            if(cfd >= 0) {
+                conn = malloc(sizeof(MConn));
+                conn->fd = cfd;
+                conn->len = 0;
+                conn->toolong = false;
+                setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                ev.events = EPOLLIN | EPOLLONESHOT;
+                ev.data.ptr = conn;
+                epoll_ctl(srv.epfd, EPOLL_CTL_ADD, cfd, &ev);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&srv.lock);
+    srv.stopping = true;
+    pthread_cond_broadcast(&srv.ready);
+    pthread_mutex_unlock(&srv.lock);
+    for(i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for(i = 0; i < nthreads; i++) {
+        free(workers[i].out);
+    }
+    // Clients still connected are dropped along with the process
+    close(srv.epfd);
+    close(lfd);
+    unlink(path);
+    pthread_mutex_destroy(&srv.lock);
+    pthread_cond_destroy(&srv.ready);
+    free(srv.queue);
+    free(workers);
+    free(threads);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return started ? result : -1;
+}
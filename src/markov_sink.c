@@ -0,0 +1,165 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <fcntl.h>
+
+/*****
+ * Output sink
+ *****/
+static void* msink_writer(void *arg) {
+    /* Writer thread: wait for a full buffer, write it out, hand it back.
+     * Exits once the sink is closed and nothing is left to write. */
+    MSink *s = arg;
+    uint64_t t = 0;
+    ssize_t n = 0;
+    size_t off = 0;
+    int b = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while(true) {
+        while((s->pending < 0) && !s->closing) {
+            pthread_cond_wait(&s->ready, &s->lock);
+        }
+        if(s->pending < 0) break;
+        b = s->pending;
+        pthread_mutex_unlock(&s->lock);
+
+        if(markov_metrics_on) t = mmetrics_now();
+        for(off = 0; (off < s->len[b]) && !s->error; off += n) {
+            n = write(s->fd, s->buf[b] + off, s->len[b] - off);
+            if(n < 0) {
+                s->error = true;
+                n = 0;
+            }
+        }
+        if(markov_metrics_on) {
+            mmetrics_record(MET_WRITE, t);
+            mmetrics_count(&(mmetrics_self()->bytes), off);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        s->len[b] = 0;
+        s->pending = -1;
+        pthread_cond_signal(&s->ready);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+MSink* msink_create(int fd, bool owned) {
+    /* Wrap an open file descriptor. The sink closes it when it is closed if
+     * owned is true. Returns NULL if the writer thread can't be started. */
+    MSink *s = malloc(sizeof(MSink));
+    s->fd = fd;
+    s->owned = owned;
+    s->cur = 0;
+    s->pending = -1;
+    s->closing = false;
+    s->error = false;
+    s->buf[0] = malloc(MSINKSZ);
+    s->buf[1] = malloc(MSINKSZ);
+    s->len[0] = 0;
+    s->len[1] = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+    if(pthread_create(&s->writer, NULL, msink_writer, s) != 0) {
+        fprintf(stderr, "Unable to start writer thread.\n");
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->ready);
+        free(s->buf[0]);
+        free(s->buf[1]);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+MSink* msink_open(char *fname, bool append) {
+    /* Open fname for writing, appending to it or truncating it. Returns NULL
+     * if the file can't be opened. */
+    MSink *s = NULL;
+    int fd = open(fname, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC),
+            0644);
+    if(fd < 0) return NULL;
+    s = msink_create(fd, true);
+    if(!s) close(fd);
+    return s;
+}
+
+static void msink_swap(MSink *s) {
+    /* Hand the current buffer to the writer and carry on in the other one.
+     * This only waits if the writer is still busy with the other buffer. */
+    pthread_mutex_lock(&s->lock);
+    while(s->pending >= 0) {
+        pthread_cond_wait(&s->ready, &s->lock);
+    }
+    s->pending = s->cur;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+    s->cur ^= 1;
+}
+
+void msink_write(MSink *s, const char *data, size_t n) {
+    /* Copy n bytes into the sink */
+    size_t m = 0;
+    while(n) {
+        m = MSINKSZ - s->len[s->cur];
+        if(m > n) m = n;
+        memcpy(s->buf[s->cur] + s->len[s->cur], data, m);
+        s->len[s->cur] += m;
+        data += m;
+        n -= m;
+        if(s->len[s->cur] == MSINKSZ) {
+            msink_swap(s);
+        }
+    }
+}
+
+void msink_puts(MSink *s, const char *str, char sep) {
+    // Write a string followed by sep
+    msink_write(s, str, strlen(str));
+    msink_write(s, &sep, 1);
+}
+
+int msink_close(MSink *s) {
+    /* Write out whatever is buffered, stop the writer and free the sink.
+     * Returns 0, or -1 if any write failed. */
+    int result = 0;
+    if(!s) return 0;
+    if(s->len[s->cur]) {
+        msink_swap(s);
+    }
+    pthread_mutex_lock(&s->lock);
+    s->closing = true;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->writer, NULL);
+
+    result = s->error ? -1 : 0;
+    if(s->owned) {
+        close(s->fd);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->ready);
+    free(s->buf[0]);
+    free(s->buf[1]);
+    free(s);
+    return result;
+}
@@ -0,0 +1,213 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+#include <math.h>
+
+/*****
+ * Model statistics
+ *****/
+static double stats_entropy(unsigned int *counts, int stride, int n,
+        double total) {
+    // Bits of -sum(p log2 p) over n counts, stride bytes apart
+    double h = 0;
+    double p = 0;
+    int i = 0;
+    for(i = 0; i < n; i++) {
+        p = *(unsigned int*)((char*)counts + (size_t)i * stride) / total;
+        if(p > 0) h -= p * log2(p);
+    }
+    return h;
+}
+
+void mht_stats(MHTable *ht, MStats *st) {
+    /* Measure a table: how full it is and how far keys sit from their home
+     * slot, how many ways each context branches and how unpredictable it is,
+     * contexts generation can't use, the start distribution, and the bytes
+     * held by each array. Works on finalized and training tables alike. */
+    MHTNode *node = NULL;
+    double weight[KEYMAX + 1];
+    double p[256];
+    double h = 0;
+    double sumprobe = 0;
+    double allweight = 0;
+    unsigned int mask = ht->size - 1;
+    int probe = 0;
+    int len = 0;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    memset(st, 0, sizeof(MStats));
+    memset(weight, 0, sizeof(weight));
+    for(i = 0; i < STATS_TOPSTARTS; i++) {
+        st->topstarts[i] = -1;
+    }
+    st->keys = ht->count;
+    st->slots = ht->size;
+    st->load = ht->size ? (double)ht->count / ht->size : 0;
+
+    for(i = 0; i < ht->size; i++) {
+        node = &(ht->items[i]);
+        if(!node->key[0]) continue;
+        probe = (i - (node->hash & mask)) & mask;
+        sumprobe += probe;
+        if(probe > st->maxprobe) st->maxprobe = probe;
+        st->probes[(probe < STATS_PROBES) ? probe : STATS_PROBES - 1] += 1;
+
+        len = strlen(node->key);
+        st->contexts[len] += 1;
+        st->branching[len] += node->nnexts;
+        if(node->nnexts > st->maxbranch) st->maxbranch = node->nnexts;
+        if(!node->nvalues) {
+            st->empty += 1;
+            continue;
+        }
+        if(node->nvalues < ht->minobs) st->sparse += 1;
+        if((node->nnexts == 1) && !mht_follow_ch(ht, node->first)) {
+            st->endonly += 1;
+        }
+        // Probabilities rather than counts, which quantized rows don't have
+        mhtnode_probs(ht, node, p);
+        h = 0;
+        for(j = 0; j < node->nnexts; j++) {
+            if(p[j] > 0) h -= p[j] * log2(p[j]);
+        }
+        if(h > st->maxentropy) st->maxentropy = h;
+        // Weighted by how often the context is passed through
+        st->entropy[len] += h * node->nvalues;
+        weight[len] += node->nvalues;
+        st->meanentropy += h * node->nvalues;
+        allweight += node->nvalues;
+    }
+    st->meanprobe = ht->count ? sumprobe / ht->count : 0;
+    for(len = 1; len <= KEYMAX; len++) {
+        st->meanbranch += st->branching[len];
+        if(st->contexts[len]) st->branching[len] /= st->contexts[len];
+        if(weight[len] > 0) st->entropy[len] /= weight[len];
+    }
+    if(ht->count) st->meanbranch /= ht->count;
+    if(allweight > 0) st->meanentropy /= allweight;
+
+    // Starts, the most common kept sorted by insertion
+    st->nstarts = ht->nstarts;
+    for(i = 0; i < ht->nstarts; i++) {
+        st->startwords += ht->starts[i].count;
+        for(j = 0; j < STATS_TOPSTARTS; j++) {
+            if((st->topstarts[j] < 0) ||
+                    (ht->starts[i].count > ht->starts[st->topstarts[j]].count)) {
+                break;
+            }
+        }
+        if(j == STATS_TOPSTARTS) continue;
+        for(k = STATS_TOPSTARTS - 1; k > j; k--) {
+            st->topstarts[k] = st->topstarts[k - 1];
+        }
+        st->topstarts[j] = i;
+    }
+    if(st->startwords) {
+        st->startentropy = stats_entropy(&(ht->starts[0].count),
+                sizeof(MStart), ht->nstarts, (double)st->startwords);
+    }
+
+    st->slotbytes = sizeof(MHTNode) * (size_t)ht->size;
+    st->followbytes = mht_follow_size(ht) * (size_t)ht->fcap;
+    st->startbytes = sizeof(MStart) * (size_t)ht->nstarts;
+    st->densebytes = ht->dense ? sizeof(int) * (size_t)ht->drows : 0;
+    if(ht->map) {
+        st->heldbytes = ht->mapsize;
+    } else if(ht->arena) {
+        st->heldbytes = arena_size(ht->arena);
+    } else {
+        st->heldbytes = st->slotbytes + st->followbytes + st->startbytes +
+            st->densebytes;
+    }
+}
+
+static void stats_write_string(FILE *f, char *str) {
+    // A JSON string, escaping what the corpus might contain
+    fputc('"', f);
+    for(; *str; str++) {
+        if((*str == '"') || (*str == '\\')) {
+            fprintf(f, "\\%c", *str);
+        } else if((unsigned char)*str < 0x20) {
+            fprintf(f, "\\u%04x", (unsigned char)*str);
+        } else {
+            fputc(*str, f);
+        }
+    }
+    fputc('"', f);
+}
+
+void mht_write_stats(MHTable *ht, FILE *f) {
+    /* mht_stats as one JSON object */
+    MStats st;
+    MStart *s = NULL;
+    char key[KEYMAX * 4 + 1];
+    int len = 0;
+    int i = 0;
+
+    mht_stats(ht, &st);
+    fprintf(f, "{\"order\": %d, \"minobs\": %d, \"finalized\": %s, "
+            "\"dense\": %s,\n", ht->order, ht->minobs,
+            (ht->arena || ht->map) ? "true" : "false",
+            ht->dense ? "true" : "false");
+    fprintf(f, " \"contexts\": %d, \"contexts_by_order\": [", st.keys);
+    for(len = 1; len <= ht->order; len++) {
+        fprintf(f, "%d%s", st.contexts[len], (len < ht->order) ? ", " : "]");
+    }
+    fprintf(f, ",\n \"hash\": {\"slots\": %d, \"load_factor\": %.4f, "
+            "\"mean_probe\": %.4f, \"max_probe\": %d, \"probe_histogram\": [",
+            st.slots, st.load, st.meanprobe, st.maxprobe);
+    for(i = 0; i < STATS_PROBES; i++) {
+        fprintf(f, "%d%s", st.probes[i], (i < STATS_PROBES - 1) ? ", " : "]},\n");
+    }
+    fprintf(f, " \"branching\": {\"mean\": %.4f, \"max\": %d, \"by_order\": [",
+            st.meanbranch, st.maxbranch);
+    for(len = 1; len <= ht->order; len++) {
+        fprintf(f, "%.4f%s", st.branching[len], (len < ht->order) ? ", " : "]},\n");
+    }
+    fprintf(f, " \"entropy_bits\": {\"mean\": %.4f, \"max\": %.4f, \"by_order\": [",
+            st.meanentropy, st.maxentropy);
+    for(len = 1; len <= ht->order; len++) {
+        fprintf(f, "%.4f%s", st.entropy[len], (len < ht->order) ? ", " : "]},\n");
+    }
+    fprintf(f, " \"dead_ends\": {\"empty\": %d, \"end_only\": %d, "
+            "\"below_minobs\": %d},\n", st.empty, st.endonly, st.sparse);
+    fprintf(f, " \"words\": {\"shortest\": %d, \"longest\": %d, "
+            "\"non_ascii_chars\": %d},\n", ht->wmin, ht->wmax, ht->nsyms);
+    fprintf(f, " \"starts\": {\"distinct\": %d, \"words\": %ld, "
+            "\"entropy_bits\": %.4f, \"top\": [", st.nstarts, st.startwords,
+            st.startentropy);
+    for(i = 0; (i < STATS_TOPSTARTS) && (st.topstarts[i] >= 0); i++) {
+        s = &(ht->starts[st.topstarts[i]]);
+        fprintf(f, "%s{\"key\": ", i ? ", " : "");
+        markov_decode_name(ht, ht->items[s->slot].key,
+                strlen(ht->items[s->slot].key), key, sizeof(key), false);
+        stats_write_string(f, key);
+        fprintf(f, ", \"count\": %u}", s->count);
+    }
+    fprintf(f, "]},\n");
+    fprintf(f, " \"quantized_bits\": %d,\n", ht->qfollows ? ht->qbits : 0);
+    fprintf(f, " \"memory_bytes\": {\"slots\": %zu, \"followers\": %zu, "
+            "\"starts\": %zu, \"dense\": %zu, \"held\": %zu, "
+            "\"per_context\": %.1f}}\n", st.slotbytes, st.followbytes,
+            st.startbytes, st.densebytes, st.heldbytes,
+            st.keys ? (double)st.heldbytes / st.keys : 0);
+}
@@ -18,376 +18,734 @@
 * along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <markov.h>
+#include <sys/mman.h>
 
 /*****
  * Structure creation
  *****/
 
-MHTNode* create_mhtnode(char *key, CList *values) {
-    MHTNode *item = malloc(sizeof(MHTNode));
-    // Don't forget the \0 at the end of the string!
-    item->key = malloc(sizeof(char) * (strlen(key) + 1));
-    item->values = values;
-    strcpy(item->key,key);
-    item->nvalues = clist_count(values);
-    return item;
-}
-
-MHTable* create_mhtable(int size) {
-    int i = 0;
+MHTable* create_mhtable(int size, int order) {
+    /* Create an empty table with room for at least size slots. The slot count
+     * is always a power of two, so an index is just the hash masked. */
     MHTable *table = malloc(sizeof(MHTable));
-    table->size = size;
+    table->size = 16;
+    while(table->size < size) {
+        table->size *= 2;
+    }
     table->count = 0;
-    // Calloc for clean fresh memory?
-    table->items = calloc(table->size, sizeof(MHTNode*));
-    for(i = 0; i < table->size; i++) {
-        table->items[i] = NULL;
-    } 
-    table->ofbuckets = create_mht_ofbuckets(table);
-    table->keys = NULL;
-    table->stkeys = NULL;
+    table->order = order;
+    table->minobs = BACKOFF;
+    // Calloc for clean fresh memory, a slot with an empty key is unused
+    table->items = calloc(table->size, sizeof(MHTNode));
     table->wmax = 0;
     table->wmin = 0;
+    memset(table->lens, 0, sizeof(table->lens));
+    table->follows = NULL;
+    table->qfollows = NULL;
+    table->qbits = 0;
+    table->nfollows = 0;
+    table->fcap = 0;
+    table->starts = NULL;
+    table->nstarts = 0;
+    table->map = NULL;
+    table->mapsize = 0;
+    table->arena = NULL;
+    table->nsyms = 0;
+    memset(table->symof, 0, sizeof(table->symof));
+    mht_create_dense(table);
     return table;
 }
 
-MHTList** create_mht_ofbuckets(MHTable *table) {
-    MHTList **buckets = calloc(table->size, sizeof(MHTList*));
-    int i;
-    for(i = 0; i < table->size; i++) {
-        buckets[i] = NULL;
-    }
-    return buckets;
-}
+/*****
+ * Structure destruction
+ *****/
 
-MHTList* create_mhtlist(MHTNode *item) {
-    MHTList *list = malloc(sizeof(MHTList));
-    if(!list) {
-        return NULL;
+void destroy_mhtable(MHTable *table) {
+    if(table->arena) {
+        // The arrays of a finalized table are all in its arena
+        destroy_arena(table->arena);
+    } else if(table->map) {
+        // The arrays live in the model file mapping
+        munmap(table->map, table->mapsize);
+    } else {
+        free(table->follows);
+        free(table->items);
+        free(table->starts);
+        free(table->dense);
     }
-    list->data = item;
-    list->next = NULL;
-    return list;
+    free(table);
 }
 
 /*****
- * Structure destruction
+ * MHTable functions
  *****/
+unsigned long mht_hash(char *s) {
+    /* FNV-1a over the key, then the 64 bit finalizer from MurmurHash3 so the
+     * low bits (the ones used as the index) depend on every character */
+    unsigned long long h = 0xcbf29ce484222325ULL;
 
-void destroy_mhtnode(MHTNode *item) {
-    if(!item) {
-        return;
+    for(; *s != '\0'; s++) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
     }
-    free(item->key);
-    destroy_clist(item->values);
-    free(item);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (unsigned long)h;
 }
 
-void destroy_mhtable(MHTable *table) {
-    int i = 0;
-    MHTNode *item = NULL;
-    for(i = 0; i < table->size; i++) {
-        item = table->items[i];
-        if(item) {
-            destroy_mhtnode(item);
+static int mht_find_slot(MHTable *ht, char *key, unsigned int hash) {
+    /* Linear probe from the key's home slot. Returns the slot holding key, or
+     * the empty slot where it would go. The table is never allowed to fill up,
+     * so this always stops. */
+    unsigned int mask = ht->size - 1;
+    unsigned int i = hash & mask;
+    MHTNode *node = NULL;
+    while(1) {
+        node = &(ht->items[i]);
+        if(!node->key[0]) {
+            return i;
+        }
+        if((node->hash == hash) && (strcmp(node->key, key) == 0)) {
+            return i;
         }
+        i = (i + 1) & mask;
     }
-    destroy_mht_ofbuckets(table);
-    destroy_slist(&(table->keys));
-    destroy_slist(&(table->stkeys));
-    free(table->items);
-    free(table);
 }
 
-void destroy_mht_ofbuckets(MHTable *table) {
-    MHTList **buckets = table->ofbuckets;
-    int i;
-    for(i = 0; i < table->size; i++) {
-        destroy_mhtlist(buckets[i]);
-    }
-    free(buckets);
-}
+void mht_resize(MHTable *ht, int size) {
+    /* Move every key into a new slot array of (at least) size slots. Node
+     * pointers handed out before this are no longer valid afterwards. */
+    MHTNode *old = ht->items;
+    int oldsize = ht->size;
+    int i = 0;
+    int j = 0;
 
-void destroy_mhtlist(MHTList *headref) {
-    MHTList *tmp = headref;
-    while(headref) {
-        tmp = headref;
-        //printf("Destroying mhtlist %d, %s.\n",tmp->id,tmp->data->key);
-        headref = headref->next;
-        destroy_mhtnode(tmp->data);
-        free(tmp);
+    ht->size = 16;
+    while(ht->size < size) {
+        ht->size *= 2;
+    }
+    ht->items = calloc(ht->size, sizeof(MHTNode));
+    for(i = 0; i < oldsize; i++) {
+        if(old[i].key[0]) {
+            j = mht_find_slot(ht, old[i].key, old[i].hash);
+            ht->items[j] = old[i];
+        }
     }
+    free(old);
+    mht_rebuild_dense(ht);
 }
 
-/*****
- * MHTable functions
- *****/
-unsigned long mht_hash(char *s) {
-    // Hash from K&R, pg 144
-    unsigned long hashval;
+MHTNode* mht_insert_node(MHTable *table, char *key) {
+    /* Find the node for key, adding it (with no followers) the first time it
+     * is seen. The table grows if the new key would pass the maximum load
+     * factor, so earlier node pointers can be invalid afterwards. While the
+     * table is dense, keys that were already seen are found without hashing. */
+    unsigned int hash = 0;
+    int d = -1;
+    int i = 0;
+    MHTNode *cur = NULL;
 
-    for (hashval = 0; *s != '\0'; s++) {
-        hashval = *s + 31 * hashval;
+    if(table->dense) {
+        d = dense_index(key, table->order);
+        if(d < 0) {
+            mht_drop_dense(table);
+        } else if(table->dense[d] >= 0) {
+            return &(table->items[table->dense[d]]);
+        }
+    }
+    hash = mht_hash(key);
+    i = mht_find_slot(table, key, hash);
+    cur = &(table->items[i]);
+    if(!cur->key[0]) {
+        /* Key does not exist */
+        if((table->count + 1) * MAXLOAD > table->size * (MAXLOAD - 1)) {
+            mht_resize(table, table->size * 2);
+            i = mht_find_slot(table, key, hash);
+            cur = &(table->items[i]);
+        }
+        memset(cur, 0, sizeof(MHTNode));
+        strncpy(cur->key, key, KEYMAX);
+        cur->hash = hash;
+        table->count += 1;
+        if(table->dense) {
+            table->dense[d] = i;
+        }
     }
-    return hashval % CAPACITY;
-    /* Note, must return an index within the capacity of the hash table,
-     * otherwise it will access an unbounded memory location SEGFAULT */
+    return cur;
 }
 
-void mht_collision(MHTable *table, unsigned long index, MHTNode *item) { 
-    MHTList *head = table->ofbuckets[index];
-    if(!head) {
-        /* Create the list */
-        head = create_mhtlist(item);
-        table->ofbuckets[index] = head;
-    } else {
-        table->ofbuckets[index] = mhtlist_insert(head, item);
+void mht_insert(MHTable *table, char *key, char c) {
+    // Count one occurrence of c following key
+    if(table->dense && (dense_sym(c) < 0)) {
+        mht_drop_dense(table);
     }
+    mhtnode_add(table, mht_insert_node(table, key), c, 1);
 }
 
-void mht_insert(MHTable *table, char *key, CList *values) {
-    MHTNode *item = create_mhtnode(key,values);
-    int index = mht_hash(key);
-    MHTNode *cur = table->items[index];
-    CList *vlist = NULL, *ctmp = NULL;
+void mht_merge(MHTable *to, MHTable *from) {
+    /* Add every count in from (a table still being trained) to the table to,
+     * along with its starter key counts and word lengths. The symbols of from
+     * are renumbered to those of to; if to runs out of symbols, the keys and
+     * followers that don't fit are left out. */
+    MHTNode *node = NULL;
+    MFollower *f = NULL;
+    unsigned char map[256];
+    char key[KEYMAX + 1];
+    int sym = 0;
+    int i = 0;
+    int j = 0;
 
-    if(!cur) {
-        /* Key does not exist */
-        if(table->count == table->size) {
-            /* Hash table full */
-            printf("Insert error: Hash table full!\n");
-            destroy_mhtnode(item);
-            return;
-        }
-        table->items[index] = item;
-        table->count += 1;
-        // Update list of keys
-        if(!(table->keys)) {
-                table->keys = create_slist(key);
-        } else {
-            slist_push(&(table->keys), key); 
+    for(i = 0; i < 0x80; i++) {
+        map[i] = i;
+    }
+    for(i = 0; i < from->nsyms; i++) {
+        sym = mht_symbol(to, from->syms[i], true);
+        map[0x80 + i] = (sym < 0) ? 0 : sym;
+    }
+    for(i = 0; i < from->size; i++) {
+        if(!from->items[i].key[0]) continue;
+        strcpy(key, from->items[i].key);
+        if(from->nsyms) {
+            mht_map_symbols(key, map);
+            if(strlen(key) != strlen(from->items[i].key)) continue;
         }
-    } else {
-        /* Key exists at hash */
-        if(strcmp(cur->key, key) == 0) {
-            /* Same key, update value */
-            vlist = cur->values;
-            ctmp = values;
-            while(ctmp) {
-                clist_push(&vlist, ctmp->ch);
-                ctmp = ctmp->next;
+        node = mht_insert_node(to, key);
+        node->starts += from->items[i].starts;
+        f = from->follows + from->items[i].first;
+        for(j = 0; j < from->items[i].nnexts; j++) {
+            if(f[j].ch && !map[(unsigned char)f[j].ch]) continue;
+            if(to->dense && (dense_sym(map[(unsigned char)f[j].ch]) < 0)) {
+                mht_drop_dense(to);
             }
-            cur->values = vlist;
-            destroy_mhtnode(item);
-        } else {
-            /* Different key, handle collision */
-            mht_collision(table, index, item);
+            mhtnode_add(to, node, map[(unsigned char)f[j].ch], f[j].count);
         }
     }
-}
 
-CList* mht_search(MHTable *table, char *key) {
-    /*
-    int index = mht_hash(key);
-    MHTNode *item = table->items[index];
-    MHTList *head = table->ofbuckets[index];
-    while(item) {
-        if(strcmp(item->key, key) == 0) {
-            return item->values;
-        }
-        if(!head) {
-            return NULL;
-        }
-        item = head->data;
-        head = head->next;
+    for(i = 0; i < NAMEMAX; i++) {
+        to->lens[i] += from->lens[i];
     }
-    return NULL;
-    */
-    MHTNode *node = mht_search_node(table, key);
-    if(node) {
-        return node->values;
-    } else {
-        return NULL;
+    if(from->wmax > to->wmax) {
+        to->wmax = from->wmax;
+    }
+    if(from->wmin && (!to->wmin || (from->wmin < to->wmin))) {
+        to->wmin = from->wmin;
     }
 }
 
 MHTNode* mht_search_node(MHTable *ht, char *key) {
-    // Search the hashtable for a key, making sure to look at overflow buckets
-    int i = mht_hash(key);
-    MHTNode *node = ht->items[i];
-    MHTList *oflist = ht->ofbuckets[i];
-    while(node) {
-        if(strcmp(node->key, key) == 0) {
-            return node;
-        }
-        if(!oflist) {
-            return NULL;
-        }
-        node = oflist->data;
-        oflist = oflist->next;
+    // Search the hashtable for a key, NULL if it isn't there
+    MHTNode *node = NULL;
+    if(ht->dense) {
+        return mht_dense_node(ht, dense_index(key, ht->order));
+    }
+    node = &(ht->items[mht_find_slot(ht, key, mht_hash(key))]);
+    if(!node->key[0]) {
+        return NULL;
     }
-    return NULL;
+    return node;
 }
 
 void mht_delete(MHTable *table, char *key) {
-    int index = mht_hash(key);
-    MHTNode *item = table->items[index];
-    MHTList *head = table->ofbuckets[index];
-    MHTList *node = NULL;
-    MHTList *cur = NULL;
-    MHTList *prev = NULL;
-
-    if(!item) {
+    /* Remove a key. Rather than leave a tombstone, the keys after it in the
+     * probe run are shifted back into the hole when that doesn't move them in
+     * front of their home slot. The node's follower row becomes a hole in the
+     * pool until the next mht_finalize. */
+    unsigned int mask = table->size - 1;
+    unsigned int i = mht_find_slot(table, key, mht_hash(key));
+    unsigned int j = i;
+    unsigned int home = 0;
+
+    if(!table->items[i].key[0]) {
         /*Item doesn't exist */
         return;
     }
-    if(!head && (strcmp(item->key, key) == 0)) {
-        /* No collision chain, remove item set table index to NULL */
-        table->items[index] = NULL;
-        destroy_mhtnode(item);
-        slist_delete(&(table->keys),key); // Update key list
-        table->count--;
-        return;
-    } else if (head) {
-        /* Collision chain exists */
-        if(strcmp(item->key, key) == 0) {
-            /* Remove this item and set head of list as the new item */
-            destroy_mhtnode(item);
-            node = head;
-            head = head->next;
-            node->next = NULL;
-            table->items[index] = create_mhtnode(node->data->key, 
-                    node->data->values);
-            destroy_mhtlist(node);
-            table->ofbuckets[index] = head;
-            return;
-        }
-        cur = head;
-        prev = NULL;
-        while(cur) {
-            if(strcmp(cur->data->key, key) == 0) {
-                if(!prev) {
-                    /* First element of chain, remove chain */
-                    destroy_mhtlist(head);
-                    table->ofbuckets[index] = NULL;
-                    return;
-                } else {
-                    /* Somewhere else in chain */
-                    prev->next = cur->next;
-                    cur->next = NULL;
-                    destroy_mhtlist(cur);
-                    table->ofbuckets[index] = head;
-                    return;
-                }
+    if(table->dense) {
+        table->dense[dense_index(table->items[i].key, table->order)] = -1;
+    }
+    while(1) {
+        table->items[i].key[0] = '\0';
+        do {
+            j = (j + 1) & mask;
+            if(!table->items[j].key[0]) {
+                table->count--;
+                return;
             }
-            cur = cur->next;
-            prev = cur;
+            home = table->items[j].hash & mask;
+            /* Keep looking while the key at j is still reachable from its
+             * home slot without passing through the hole at i */
+        } while((i <= j) ? ((i < home) && (home <= j)) 
+                         : ((i < home) || (home <= j)));
+        table->items[i] = table->items[j];
+        if(table->dense) {
+            table->dense[dense_index(table->items[i].key, table->order)] = i;
         }
+        i = j;
     }
 }
 
 void mht_print(MHTable *table) {
-    int i = 0;
-    MHTList *head = NULL;
-    printf("\n\t********************\n");
-    printf("\tHashTable\n\t********************\n");
-    for(i = 0; i < table->size; i++) {
-        if(table->items[i]) {
-            printf("Index: %d | Key: %s | Values: ",
-                    i, table->items[i]->key);
-            clist_bracketprint(table->items[i]->values);
-            if(table->ofbuckets[i]) {
-                printf("\t=> Overflow Bucket =>\n");
-                head = table->ofbuckets[i];
-                while(head) {
-                    printf("\tKey: %s | Values: ", head->data->key);
-                    clist_bracketprint(head->data->values);
-                    head = head->next;
-                }
-            }
-        }
-    }
-    printf("\t********************\n\n");
+    mht_write_file(table, stdout);
 }
 
 void mht_print_item(MHTable *table, char *key) {
-    CList *val = mht_search(table, key);
-    if(!val) {
+    MHTNode *node = mht_search_node(table, key);
+    if(!node) {
         printf("Key: %s does not exist.\n", key);
     } else {
         printf("Key: %s | Value: ", key);
-        clist_bracketprint(val);
+        mhtnode_bracketwrite(table, node, stdout);
     }
 }
 
 void mht_write(MHTable *ht, char *fname, char *mode) {
-    int i = 0;
     FILE *f = fopen(fname,mode);
-    MHTList *head = NULL;
+    mht_write_file(ht, f);
+    fclose(f);
+}
+
+void mht_write_file(MHTable *ht, FILE *f) {
+    char key[KEYMAX * 4 + 1];
+    int i = 0;
     fprintf(f,"\n\t********************\n");
     fprintf(f, "\tHashTable\n\t********************\n");
     for(i = 0; i < ht->size; i++) {
-        if(ht->items[i]) {
-            fprintf(f,"Index: %d | Key: %s | Values: ",
-                    i, ht->items[i]->key);
-            clist_bracketwrite(ht->items[i]->values,f);
-            if(ht->ofbuckets[i]) {
-                fprintf(f,"\t=> Overflow Bucket =>\n");
-                head = ht->ofbuckets[i];
-                while(head) {
-                    fprintf(f,"\tKey: %s | Values: ", head->data->key);
-                    clist_bracketwrite(head->data->values,f);
-                    head = head->next;
+        if(ht->items[i].key[0]) {
+            markov_decode_name(ht, ht->items[i].key,
+                    strlen(ht->items[i].key), key, sizeof(key), false);
+            fprintf(f,"Index: %d | Key: %s | Values: ", i, key);
+            mhtnode_bracketwrite(ht, &(ht->items[i]), f);
+        }
+    }
+    fprintf(f,"\t********************\n\n");
+}
+
+static int mht_cmp_node(const void *a, const void *b) {
+    return strcmp(((MHTNode*)a)->key, ((MHTNode*)b)->key);
+}
+
+void mht_finalize(MHTable *ht) {
+    /* Called once training is done. The table is rebuilt so its layout only
+     * depends on what was counted, never on the order it was counted in (or
+     * how many threads counted it):
+     * - Symbols are put in codepoint order (see markov_utf8.c)
+     * - Keys are reinserted in sorted order, into a table sized by the count
+     * - Growing rows leave holes in the follower pool, so the rows are copied
+     *   back to back into a fresh pool in slot order
+     * - Each row is sorted by character and given its alias table, which
+     *   is quantized if ht->qbits is set (see markov_prune.c)
+     * - Keys with a start count go in the starts array, in slot order, with
+     *   an alias table over the counts
+     * The new arrays are laid out one after the other in a single arena
+     * block, the same order as a model file, and the training memory is
+     * released. */
+    Arena *arena = NULL;
+    MFollower *follows = NULL;
+    MHTNode *nodes = NULL;
+    MHTNode *node = NULL;
+    char *pool = NULL;
+    char *rows = ht->qfollows ? ht->qfollows : (char*)ht->follows;
+    int fsize = mht_follow_size(ht);
+    int qsize = !ht->qbits ? sizeof(MFollower) :
+        (ht->qbits == 8) ? sizeof(MFollower8) : sizeof(MFollower16);
+    int nfollows = 0;
+    int nstarts = 0;
+    int drows = ht->dense ? ht->drows : 0;
+    unsigned char map[256];
+    bool remap = mht_sort_symbols(ht, map);
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    nodes = malloc(sizeof(MHTNode) * (ht->count ? ht->count : 1));
+    for(i = 0; i < ht->size; i++) {
+        if(ht->items[i].key[0]) {
+            if(remap) {
+                // (Only a table still training gains symbols, so its rows
+                // are never quantized here)
+                node = &(ht->items[i]);
+                mht_map_symbols(node->key, map);
+                node->hash = mht_hash(node->key);
+                for(k = 0; k < node->nnexts; k++) {
+                    follows = ht->follows + node->first + k;
+                    follows->ch = map[(unsigned char)follows->ch];
                 }
             }
+            nodes[j++] = ht->items[i];
+            nfollows += ht->items[i].nnexts;
+            nstarts += ht->items[i].starts ? 1 : 0;
+        }
+    }
+    qsort(nodes, ht->count, sizeof(MHTNode), mht_cmp_node);
+    k = 16;
+    while((k < CAPACITY) || (ht->count * MAXLOAD > k * (MAXLOAD - 1))) {
+        k *= 2;
+    }
+
+    arena = create_arena(sizeof(MHTNode) * k + (size_t)qsize * nfollows +
+            sizeof(MStart) * nstarts + sizeof(int) * drows + 4 * 16);
+    if(!ht->arena && !ht->map) {
+        free(ht->items);
+    }
+    ht->size = k;
+    ht->items = arena_alloc(arena, sizeof(MHTNode) * ht->size);
+    memset(ht->items, 0, sizeof(MHTNode) * ht->size);
+    for(i = 0; i < ht->count; i++) {
+        ht->items[mht_find_slot(ht, nodes[i].key, nodes[i].hash)] = nodes[i];
+    }
+    free(nodes);
+
+    /* Rows already quantized are copied as they are. Rows about to be
+     * quantized get their alias tables in a scratch pool, so the arena only
+     * ever holds the small format. */
+    if(ht->qbits && !ht->qfollows) {
+        pool = malloc((size_t)fsize * (nfollows ? nfollows : 1));
+    } else {
+        pool = arena_alloc(arena, (size_t)fsize * nfollows);
+    }
+    nfollows = 0;
+    for(i = 0; i < ht->size; i++) {
+        node = &(ht->items[i]);
+        if(!node->key[0]) continue;
+        memcpy(pool + (size_t)fsize * nfollows, rows + (size_t)fsize * node->first,
+                (size_t)fsize * node->nnexts);
+        node->first = nfollows;
+        node->cap = node->nnexts;
+        nfollows += node->nnexts;
+    }
+    if(!ht->arena && !ht->map) {
+        free(ht->follows);
+    }
+    ht->nfollows = nfollows;
+    ht->fcap = nfollows;
+    if(ht->qfollows) {
+        ht->qfollows = pool;
+    } else {
+        ht->follows = (MFollower*)pool;
+        for(i = 0; i < ht->size; i++) {
+            if(ht->items[i].key[0]) {
+                mhtnode_build_alias(ht, &(ht->items[i]));
+            }
+        }
+        if(ht->qbits) {
+            ht->qfollows = arena_alloc(arena, (size_t)qsize * nfollows);
+            mht_quantize_rows(ht, ht->qfollows);
+            free(pool);
+            ht->follows = NULL;
+        }
+    }
+
+    if(!ht->arena && !ht->map) {
+        free(ht->starts);
+    }
+    ht->starts = arena_alloc(arena, sizeof(MStart) * nstarts);
+    ht->nstarts = 0;
+    for(i = 0; i < ht->size; i++) {
+        if(ht->items[i].key[0] && ht->items[i].starts) {
+            ht->starts[ht->nstarts].slot = i;
+            ht->starts[ht->nstarts].count = ht->items[i].starts;
+            ht->nstarts += 1;
+        }
+    }
+    mht_build_start_alias(ht);
+
+    if(drows) {
+        if(!ht->arena && !ht->map) {
+            free(ht->dense);
+        }
+        ht->dense = arena_alloc(arena, sizeof(int) * drows);
+        mht_rebuild_dense(ht);
+    }
+
+    destroy_arena(ht->arena);
+    if(ht->map) {
+        munmap(ht->map, ht->mapsize);
+        ht->map = NULL;
+        ht->mapsize = 0;
+    }
+    ht->arena = arena;
+}
+
+void mht_thaw(MHTable *ht) {
+    /* Copy the arrays of a finalized or loaded table out of its arena or
+     * file mapping, so it can be trained further. Costs one copy of the
+     * model, and does nothing if the table already owns its arrays. Quantized
+     * rows have no counts left, so they get counts rebuilt from their
+     * probabilities (see mht_dequantize_rows). */
+    MHTNode *items = NULL;
+    MFollower *follows = NULL;
+    MStart *starts = NULL;
+    int *dense = NULL;
+    int i = 0;
+
+    if(!ht->arena && !ht->map) return;
+    items = malloc(sizeof(MHTNode) * ht->size);
+    memcpy(items, ht->items, sizeof(MHTNode) * ht->size);
+    ht->items = items;
+    follows = malloc(sizeof(MFollower) * (ht->nfollows ? ht->nfollows : 1));
+    if(ht->qfollows) {
+        mht_dequantize_rows(ht, follows);
+    } else {
+        memcpy(follows, ht->follows, sizeof(MFollower) * ht->nfollows);
+    }
+    starts = malloc(sizeof(MStart) * (ht->nstarts ? ht->nstarts : 1));
+    memcpy(starts, ht->starts, sizeof(MStart) * ht->nstarts);
+    if(ht->dense) {
+        dense = malloc(sizeof(int) * ht->drows);
+        memcpy(dense, ht->dense, sizeof(int) * ht->drows);
+    }
+
+    if(ht->arena) {
+        destroy_arena(ht->arena);
+        ht->arena = NULL;
+    } else {
+        munmap(ht->map, ht->mapsize);
+        ht->map = NULL;
+        ht->mapsize = 0;
+    }
+    ht->follows = follows;
+    ht->fcap = ht->nfollows;
+    ht->starts = starts;
+    ht->dense = dense;
+    if(ht->qfollows) {
+        ht->qfollows = NULL;
+        for(i = 0; i < ht->size; i++) {
+            if(ht->items[i].key[0]) mhtnode_build_alias(ht, &(ht->items[i]));
         }
     }
-    fprintf(f,"\t********************\n\n");
-    fclose(f);
 }
+
+MHTable* mht_clone(MHTable *ht) {
+    /* Copy a finalized or loaded table, arrays and all, into an arena of its
+     * own */
+    MHTable *c = malloc(sizeof(MHTable));
+    size_t fbytes = (size_t)mht_follow_size(ht) * ht->nfollows;
+    int drows = ht->dense ? ht->drows : 0;
+
+    memcpy(c, ht, sizeof(MHTable));
+    c->map = NULL;
+    c->mapsize = 0;
+    c->arena = create_arena(sizeof(MHTNode) * ht->size + fbytes +
+            sizeof(MStart) * ht->nstarts + sizeof(int) * drows + 4 * 16);
+    c->items = arena_alloc(c->arena, sizeof(MHTNode) * ht->size);
+    memcpy(c->items, ht->items, sizeof(MHTNode) * ht->size);
+    if(ht->qfollows) {
+        c->qfollows = arena_alloc(c->arena, fbytes);
+        memcpy(c->qfollows, ht->qfollows, fbytes);
+    } else {
+        c->follows = arena_alloc(c->arena, fbytes);
+        memcpy(c->follows, ht->follows, fbytes);
+    }
+    c->starts = arena_alloc(c->arena, sizeof(MStart) * ht->nstarts);
+    memcpy(c->starts, ht->starts, sizeof(MStart) * ht->nstarts);
+    if(drows) {
+        c->dense = arena_alloc(c->arena, sizeof(int) * drows);
+        memcpy(c->dense, ht->dense, sizeof(int) * drows);
+    }
+    return c;
+}
+
 /*****
- * MHTList functions
+ * MHTNode functions
  *****/
-MHTList* mhtlist_insert(MHTList *headref, MHTNode *item) {
-    // Inserts an item and returns a reference to the head of the list
-    MHTList *newnode = create_mhtlist(item);
-    MHTList *tmp = NULL;
-    if(!headref) {
-        headref = newnode;
-        //printf("mhtlist_insert, id %d. Returned as head.\n", newnode->id);
-        return headref;
-    }else if (!headref->next) {
-        headref->next = newnode;
-        //printf("mhtlist_insert, id %d. Returned as %d head->next.\n", newnode->id,headref->id);
-        return headref;
-    }
-    tmp = headref;
-    while(tmp->next->next) {
-        /* Gets last node */
-        tmp = tmp->next;
-    }
-    tmp->next->next = newnode;
-    //printf("mhtlist_insert, id %d. returned as %d tmp->next->next.\n", newnode->id,tmp->next->id);
-    return headref;
+static void mht_reserve_follows(MHTable *ht, int n) {
+    // Make room for at least n followers in the pool
+    if(n <= ht->fcap) return;
+    ht->fcap = ht->fcap ? ht->fcap * 2 : 64;
+    if(ht->fcap < n) ht->fcap = n;
+    ht->follows = realloc(ht->follows, sizeof(MFollower) * ht->fcap);
 }
 
-MHTNode* mhtlist_pop(MHTList **headref) {
-    if(!(*headref)) {
-        return NULL;
+void mhtnode_add(MHTable *ht, MHTNode *node, char c, unsigned int count) {
+    /* Add count occurrences of c to the node's follower row. Rows live back to
+     * back in ht->follows. A full row is grown in place if it is the last row
+     * in the pool, otherwise it is moved to the end with twice the room. */
+    MFollower *f = ht->follows + node->first;
+    int i = 0;
+    int cap = 0;
+
+    node->nvalues += count;
+    for(i = 0; i < node->nnexts; i++) {
+        if(f[i].ch == c) {
+            f[i].count += count;
+            return;
+        }
     }
-    if(!(*headref)->next) {
-        return NULL;
+    if(node->nnexts == node->cap) {
+        cap = node->cap ? node->cap * 2 : 2;
+        if(node->cap && (node->first + node->cap == ht->nfollows)) {
+            mht_reserve_follows(ht, ht->nfollows + cap - node->cap);
+        } else {
+            mht_reserve_follows(ht, ht->nfollows + cap);
+            memcpy(ht->follows + ht->nfollows, ht->follows + node->first,
+                    sizeof(MFollower) * node->nnexts);
+            node->first = ht->nfollows;
+        }
+        ht->nfollows = node->first + cap;
+        node->cap = cap;
+    }
+    f = ht->follows + node->first + node->nnexts;
+    memset(f, 0, sizeof(MFollower)); // Zero the padding too, for model files
+    f->count = count;
+    f->prob = 0xffffffffU;
+    f->alias = node->nnexts;
+    f->ch = c;
+    node->nnexts += 1;
+}
+
+void mhtnode_build_alias(MHTable *ht, MHTNode *node) {
+    /* Vose's alias method. Each column i of the row gets a threshold and an
+     * alias, so a sample is one uniform column pick and one coin flip: keep i
+     * if the coin is under the threshold, otherwise take the alias. Weights
+     * are scaled by nnexts so they compare against nvalues in integers. Rows
+     * are also sorted by character here, before the aliases point into them. */
+    MFollower *f = ht->follows + node->first;
+    MFollower tmp;
+    unsigned long long w[256];
+    unsigned long long total = node->nvalues;
+    unsigned char small[256];
+    unsigned char large[256];
+    int ns = 0;
+    int nl = 0;
+    int i = 0;
+    int j = 0;
+    int s = 0;
+    int l = 0;
+
+    for(i = 1; i < node->nnexts; i++) {
+        tmp = f[i];
+        for(j = i; j > 0 && (unsigned char)f[j-1].ch > (unsigned char)tmp.ch; j--) {
+            f[j] = f[j-1];
+        }
+        f[j] = tmp;
+    }
+    for(i = 0; i < node->nnexts; i++) {
+        w[i] = (unsigned long long)f[i].count * node->nnexts;
+        f[i].prob = 0xffffffffU;
+        f[i].alias = i;
+        if(w[i] < total) {
+            small[ns++] = i;
+        } else {
+            large[nl++] = i;
+        }
+    }
+    while(ns && nl) {
+        s = small[--ns];
+        l = large[--nl];
+        f[s].prob = (unsigned int)((w[s] << 32) / total);
+        f[s].alias = l;
+        w[l] = w[l] + w[s] - total;
+        if(w[l] < total) {
+            small[ns++] = l;
+        } else {
+            large[nl++] = l;
+        }
+    }
+    // Anything left over is (up to rounding) a full column, and keeps itself
+}
+
+void mht_build_start_alias(MHTable *ht) {
+    /* The same alias method as mhtnode_build_alias, over the start counts.
+     * There can be any number of starter keys, so the work lists are
+     * allocated. */
+    MStart *st = ht->starts;
+    unsigned long long *w = NULL;
+    unsigned long long total = 0;
+    int *small = NULL;
+    int *large = NULL;
+    int ns = 0;
+    int nl = 0;
+    int i = 0;
+    int s = 0;
+    int l = 0;
+
+    if(!ht->nstarts) return;
+    w = malloc(sizeof(unsigned long long) * ht->nstarts);
+    small = malloc(sizeof(int) * ht->nstarts);
+    large = malloc(sizeof(int) * ht->nstarts);
+    for(i = 0; i < ht->nstarts; i++) {
+        total += st[i].count;
+    }
+    for(i = 0; i < ht->nstarts; i++) {
+        w[i] = (unsigned long long)st[i].count * ht->nstarts;
+        st[i].prob = 0xffffffffU;
+        st[i].alias = i;
+        if(w[i] < total) {
+            small[ns++] = i;
+        } else {
+            large[nl++] = i;
+        }
+    }
+    while(ns && nl) {
+        s = small[--ns];
+        l = large[--nl];
+        st[s].prob = (unsigned int)((w[s] << 32) / total);
+        st[s].alias = l;
+        w[l] = w[l] + w[s] - total;
+        if(w[l] < total) {
+            small[ns++] = l;
+        } else {
+            large[nl++] = l;
+        }
+    }
+    free(w);
+    free(small);
+    free(large);
+}
+
+char mhtnode_get_random(MHTable *ht, MHTNode *node, Rng *rng) {
+    /* Pick a follower of node, weighted by count, in constant time. A
+     * quantized row compares the top bits of the coin with its threshold. */
+    MFollower *f = NULL;
+    MFollower8 *f8 = NULL;
+    MFollower16 *f16 = NULL;
+    int i = 0;
+    if(!node->nnexts) return '\0';
+    i = rng_below(rng, node->nnexts);
+    if(!ht->qfollows) {
+        f = ht->follows + node->first;
+        if(rng_u32(rng) >= f[i].prob) {
+            i = f[i].alias;
+        }
+        return f[i].ch;
+    }
+    if(ht->qbits == 8) {
+        f8 = (MFollower8*)ht->qfollows + node->first;
+        if((rng_u32(rng) >> 24) >= f8[i].prob) {
+            i = f8[i].alias;
+        }
+        return f8[i].ch;
     }
-    MHTList *node = (*headref)->next;
-    MHTList *tmp = *headref;
-    MHTNode *item = NULL;
-    tmp->next = NULL;
-    *headref = node;
-    memcpy(tmp->data, item, sizeof(MHTNode));
-    free(tmp->data->key);
-    destroy_clist(tmp->data->values);
-    free(tmp->data);
-    free(tmp);
-    return item;
+    f16 = (MFollower16*)ht->qfollows + node->first;
+    if((rng_u32(rng) >> 16) >= f16[i].prob) {
+        i = f16[i].alias;
+    }
+    return f16[i].ch;
 }
 
+void mhtnode_bracketwrite(MHTable *ht, MHTNode *node, FILE *f) {
+    /* Helper function for mht_write(...), prints ['a':3,' ':1], or each
+     * follower's probability if the rows are quantized */
+    double p[256];
+    char ch[5];
+    char c = 0;
+    int i = 0;
+    if(!node->nnexts) {
+        fprintf(f,"\n");
+        return;
+    }
+    if(ht->qfollows) mhtnode_probs(ht, node, p);
+    fprintf(f,"[");
+    for(i = 0; i < node->nnexts; i++) {
+        c = mht_follow_ch(ht, node->first + i);
+        markov_decode_name(ht, c ? &c : " ", 1, ch, sizeof(ch), false);
+        if(ht->qfollows) {
+            fprintf(f,"\'%s\':%.4f", ch, p[i]);
+        } else {
+            fprintf(f,"\'%s\':%u", ch, ht->follows[node->first + i].count);
+        }
+        fprintf(f, (i + 1 < node->nnexts) ? "," : "]\n");
+    }
+}
@@ -0,0 +1,287 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+
+/*****
+ * Name templates
+ *
+ * A template is text with slots, "{genre} {species:lower}", each slot naming
+ * a model. Every distinct model is trained (or loaded) on its own thread, and
+ * a name is made by filling the slots left to right into one buffer, so the
+ * parts never exist as separate lists.
+ *****/
+typedef struct MTplPart MTplPart; // Literal text and the slot after it
+
+struct MTplPart {
+    char *text;             // Literal text before the slot
+    int model;              // Index in the template's models, -1 for none
+    int mod;                // TPL_ASIS, TPL_LOWER, TPL_UPPER or TPL_TITLE
+};
+
+struct MTemplate {
+    MTplPart *parts;
+    int nparts;
+    char **names;           // Model names, as written in the slots
+    char **paths;           // Corpus or model file of each, NULL until bound
+    MHTable **models;
+    int nmodels;
+};
+
+static const char *tpl_mods[] = {"", "lower", "upper", "title"}; // By TPL_*
+
+static int mtpl_model(MTemplate *t, char *name, int len) {
+    // Index of the model called name (len characters), added if new
+    int i = 0;
+    for(i = 0; i < t->nmodels; i++) {
+        if(!strncmp(t->names[i], name, len) && !t->names[i][len]) return i;
+    }
+    t->names = realloc(t->names, sizeof(char*) * (t->nmodels + 1));
+    t->paths = realloc(t->paths, sizeof(char*) * (t->nmodels + 1));
+    t->names[i] = strndup(name, len);
+    t->paths[i] = NULL;
+    t->nmodels++;
+    return i;
+}
+
+MTemplate* markov_template_parse(char *spec) {
+    /* Split spec into literal text and {model} or {model:modifier} slots.
+     * "{{" and "}}" stand for literal braces. Returns NULL, with a message,
+     * if a slot is unclosed, empty, or has an unknown modifier. */
+    MTemplate *t = calloc(1, sizeof(MTemplate));
+    MTplPart *p = NULL;
+    char *text = malloc(strlen(spec) + 1);
+    char *end = NULL;
+    char *colon = NULL;
+    char *err = NULL;
+    int len = 0;
+    int i = 0;
+
+    while(!err) {
+        if(((spec[0] == '{') && (spec[1] == '{')) ||
+                ((spec[0] == '}') && (spec[1] == '}'))) {
+            text[len++] = spec[0];
+            spec += 2;
+            continue;
+        }
+        if(*spec && (*spec != '{')) {
+            text[len++] = *spec++;
+            continue;
+        }
+        // A slot or the end, either closes the current part
+        t->parts = realloc(t->parts, sizeof(MTplPart) * (t->nparts + 1));
+        p = &(t->parts[t->nparts++]);
+        p->text = strndup(text, len);
+        p->model = -1;
+        p->mod = TPL_ASIS;
+        len = 0;
+        if(!*spec) break;
+        end = strchr(spec, '}');
+        colon = memchr(spec, ':', end ? end - spec : 0);
+        if(!end) {
+            err = "unclosed {";
+        } else if((colon ? colon : end) == spec + 1) {
+            err = "empty slot";
+        } else if(colon) {
+            for(i = 1; i < TPL_NMODS; i++) {
+                if(((int)strlen(tpl_mods[i]) == end - colon - 1) &&
+                        !strncmp(tpl_mods[i], colon + 1, end - colon - 1)) {
+                    p->mod = i;
+                }
+            }
+            if(p->mod == TPL_ASIS) err = "unknown modifier (lower, upper or title)";
+        }
+        if(!err) {
+            p->model = mtpl_model(t, spec + 1, (colon ? colon : end) - spec - 1);
+            spec = end + 1;
+        }
+    }
+    free(text);
+    if(err) {
+        fprintf(stderr, "Bad template: %s\n", err);
+        destroy_mtemplate(t);
+        return NULL;
+    }
+    if(!t->nmodels) {
+        fprintf(stderr, "Bad template: no {model} slots\n");
+        destroy_mtemplate(t);
+        return NULL;
+    }
+    return t;
+}
+
+int markov_template_bind(MTemplate *t, char *binding) {
+    /* "name=file": the model called name is trained on (or, for a model file,
+     * loaded from) file instead of DATADIR/name.txt. Returns -1 if binding
+     * has no '=' or the template has no such model. */
+    char *eq = strchr(binding, '=');
+    int i = 0;
+    if(!eq) return -1;
+    for(i = 0; i < t->nmodels; i++) {
+        if(!strncmp(t->names[i], binding, eq - binding) &&
+                !t->names[i][eq - binding]) {
+            free(t->paths[i]);
+            t->paths[i] = strdup(eq + 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+typedef struct MTplLoad MTplLoad; // One model to train or load
+
+struct MTplLoad {
+    char *path;
+    int order;
+    MHTable *ht;            // Result, NULL on failure
+};
+
+static void* mtpl_load_worker(void *arg) {
+    /* Load the file if it is a model file, train on it otherwise */
+    MTplLoad *l = arg;
+    char magic[4] = {0};
+    FILE *f = fopen(l->path, "rb");
+    if(f) {
+        if(fread(magic, 1, 4, f) != 4) magic[0] = '\0';
+        fclose(f);
+    }
+    if(!memcmp(magic, "MKV", 4)) {
+        l->ht = mht_load(l->path);
+    } else {
+        l->ht = markov_train_files(&(l->path), 1, l->order, 1);
+    }
+    return NULL;
+}
+
+int markov_template_load(MTemplate *t, char *datadir, int order, int minobs) {
+    /* Train or load every model at once, one thread each. Models not bound
+     * to a file use datadir/name.txt. minobs, if not 0, replaces each model's
+     * back off count. Returns -1 if any model couldn't be made. */
+    MTplLoad *loads = calloc(t->nmodels, sizeof(MTplLoad));
+    pthread_t *threads = calloc(t->nmodels, sizeof(pthread_t));
+    bool *started = calloc(t->nmodels, sizeof(bool));
+    int result = 0;
+    int i = 0;
+
+    for(i = 0; i < t->nmodels; i++) {
+        if(!t->paths[i]) {
+            t->paths[i] = malloc(strlen(datadir) + strlen(t->names[i]) + 6);
+            sprintf(t->paths[i], "%s/%s.txt", datadir, t->names[i]);
+        }
+        loads[i].path = t->paths[i];
+        loads[i].order = order;
+        started[i] = (pthread_create(&threads[i], NULL, mtpl_load_worker,
+                    &loads[i]) == 0);
+    }
+    t->models = calloc(t->nmodels, sizeof(MHTable*));
+    for(i = 0; i < t->nmodels; i++) {
+        if(started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            mtpl_load_worker(&loads[i]);
+        }
+        t->models[i] = loads[i].ht;
+        if(!t->models[i]) {
+            fprintf(stderr, "No model for {%s} from \"%s\"\n", t->names[i],
+                    t->paths[i]);
+            result = -1;
+        } else if(minobs) {
+            t->models[i]->minobs = minobs;
+        }
+    }
+    free(loads);
+    free(threads);
+    free(started);
+    return result;
+}
+
+int markov_template_generate(MTemplate *t, Rng *rng, char *out, int cap) {
+    /* Fill the template into out (cap bytes, including the '\0'), cutting
+     * it short if it doesn't fit. Models are only read, so threads with their
+     * own rng can share the template. Returns the length. */
+    MTplPart *p = NULL;
+    int len = 0;
+    int n = 0;
+    int i = 0;
+
+    out[0] = '\0';
+    for(i = 0; (i < t->nparts) && (len < cap - 1); i++) {
+        p = &(t->parts[i]);
+        n = snprintf(out + len, cap - len, "%s", p->text);
+        len = (n < cap - len) ? len + n : cap - 1;
+        if((p->model < 0) || (len >= cap - 1)) continue;
+        n = markov_generate_name(t->models[p->model], rng, out + len,
+                (cap - len < NAMEMAX) ? cap - len : NAMEMAX);
+        // Names come capitalized, so :title only lowercases the rest
+        if(p->mod != TPL_ASIS) {
+            utf8_change_case(out + len, n, p->mod == TPL_UPPER,
+                    (p->mod == TPL_TITLE) ? 1 : 0);
+        }
+        len += n;
+    }
+    return len;
+}
+
+int markov_template_batch(MTemplate *t, int n, unsigned long seed,
+        unsigned long offset, MSink *out, char sep) {
+    /* Write n filled templates to out, each followed by sep, in one pass.
+     * As in markov_generate_batch, the Philox rng gives name k its own
+     * stream, so offset picks where in the seed's names to start. Returns the
+     * number written. */
+    char name[TEMPLATEMAX];
+    Rng rng;
+    int len = 0;
+    int i = 0;
+
+    rng_seed(&rng, seed, 0);
+    for(i = 0; i < n; i++) {
+        if(rng.kind == RNG_PHILOX) {
+            rng_seed_kind(&rng, RNG_PHILOX, seed, offset + i);
+        }
+        len = markov_template_generate(t, &rng, name, TEMPLATEMAX);
+        msink_write(out, name, len);
+        msink_write(out, &sep, 1);
+    }
+    return n;
+}
+
+MHTable* markov_template_model(MTemplate *t, int i, char **name) {
+    // Model i (NULL past the last), and its name in name if not NULL
+    if((i < 0) || (i >= t->nmodels)) return NULL;
+    if(name) *name = t->names[i];
+    return t->models ? t->models[i] : NULL;
+}
+
+void destroy_mtemplate(MTemplate *t) {
+    int i = 0;
+    if(!t) return;
+    for(i = 0; i < t->nparts; i++) {
+        free(t->parts[i].text);
+    }
+    for(i = 0; i < t->nmodels; i++) {
+        free(t->names[i]);
+        free(t->paths[i]);
+        if(t->models && t->models[i]) destroy_mhtable(t->models[i]);
+    }
+    free(t->parts);
+    free(t->names);
+    free(t->paths);
+    free(t->models);
+    free(t);
+}
@@ -0,0 +1,110 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+
+/*****
+ * Concurrent set of generated names
+ *****/
+MUniq* create_muniq(int expected) {
+    /* Create a set sized for about expected names. Each stripe is its own
+     * open addressing table with its own lock and arena, and grows on its
+     * own, so threads only contend when they hash to the same stripe. */
+    MUniq *u = malloc(sizeof(MUniq));
+    int size = 16;
+    int i = 0;
+
+    while(size * (MAXLOAD - 1) < (expected / UNIQSTRIPES + 1) * MAXLOAD) {
+        size *= 2;
+    }
+    u->retries = 0;
+    u->saturated = false;
+    for(i = 0; i < UNIQSTRIPES; i++) {
+        pthread_mutex_init(&u->stripes[i].lock, NULL);
+        u->stripes[i].size = size;
+        u->stripes[i].count = 0;
+        u->stripes[i].items = calloc(size, sizeof(MUniqItem));
+        u->stripes[i].arena = create_arena(ARENASZ);
+    }
+    return u;
+}
+
+void destroy_muniq(MUniq *u) {
+    int i = 0;
+    if(!u) return;
+    for(i = 0; i < UNIQSTRIPES; i++) {
+        pthread_mutex_destroy(&u->stripes[i].lock);
+        free(u->stripes[i].items);
+        destroy_arena(u->stripes[i].arena);
+    }
+    free(u);
+}
+
+static int muniq_find_slot(MUniqStripe *st, char *s, unsigned long hash) {
+    // Slot holding s, or the empty slot where it would go
+    int i = (hash / UNIQSTRIPES) & (st->size - 1);
+    while(st->items[i].str) {
+        if((st->items[i].hash == hash) && (strcmp(st->items[i].str, s) == 0)) {
+            break;
+        }
+        i = (i + 1) & (st->size - 1);
+    }
+    return i;
+}
+
+static void muniq_grow(MUniqStripe *st) {
+    /* Double the stripe. The strings stay where they are in the arena, only
+     * the slots move. */
+    MUniqItem *old = st->items;
+    int oldsize = st->size;
+    int i = 0;
+
+    st->size *= 2;
+    st->items = calloc(st->size, sizeof(MUniqItem));
+    for(i = 0; i < oldsize; i++) {
+        if(old[i].str) {
+            st->items[muniq_find_slot(st, old[i].str, old[i].hash)] = old[i];
+        }
+    }
+    free(old);
+}
+
+bool muniq_insert(MUniq *u, char *s) {
+    /* Add s to the set. Returns true if it was added, false if it was
+     * already there. Safe to call from any number of threads. */
+    unsigned long hash = mht_hash(s);
+    MUniqStripe *st = &(u->stripes[hash & (UNIQSTRIPES - 1)]);
+    bool result = false;
+    int i = 0;
+
+    pthread_mutex_lock(&st->lock);
+    i = muniq_find_slot(st, s, hash);
+    if(!st->items[i].str) {
+        if((st->count + 1) * MAXLOAD > st->size * (MAXLOAD - 1)) {
+            muniq_grow(st);
+            i = muniq_find_slot(st, s, hash);
+        }
+        st->items[i].hash = hash;
+        st->items[i].str = arena_strdup(st->arena, s);
+        st->count += 1;
+        result = true;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return result;
+}
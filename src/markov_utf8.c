@@ -0,0 +1,266 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <markov.h>
+
+/*****
+ * UTF-8 symbols
+ *
+ * Tables are trained on symbols, one byte per codepoint, so a key of k
+ * symbols is always exactly k characters. ASCII is its own symbol. Every
+ * other codepoint the corpus uses gets one of the bytes 128 to 255, in
+ * ht->syms; an ASCII corpus has none and nothing about it changes. Bytes that
+ * aren't valid UTF-8 are taken as Latin-1, so older corpora still read.
+ *
+ * Training threads number the codepoints they meet in their own tables,
+ * mht_merge renumbers them into the table they are merged into, and
+ * mht_finalize puts them in codepoint order, so a model is the same whatever
+ * order it was counted in.
+ *****/
+unsigned int utf8_lower(unsigned int cp) {
+    /* Lowercase of the Latin, Greek and Cyrillic letters, the rest as is */
+    if((cp >= 'A') && (cp <= 'Z')) return cp + 32;
+    if(cp < 0xc0) return cp;
+    if((cp <= 0xde) && (cp != 0xd7)) return cp + 0x20;
+    if(cp == 0x178) return 0xff;
+    if(((cp >= 0x100) && (cp <= 0x12f)) || ((cp >= 0x132) && (cp <= 0x137)) ||
+            ((cp >= 0x14a) && (cp <= 0x177))) {
+        return cp | 1;
+    }
+    if(((cp >= 0x139) && (cp <= 0x148)) || ((cp >= 0x179) && (cp <= 0x17e))) {
+        return (cp & 1) ? cp + 1 : cp;
+    }
+    if((cp >= 0x391) && (cp <= 0x3a9) && (cp != 0x3a2)) return cp + 0x20;
+    if((cp >= 0x410) && (cp <= 0x42f)) return cp + 0x20;
+    if((cp >= 0x400) && (cp <= 0x40f)) return cp + 0x50;
+    return cp;
+}
+
+unsigned int utf8_upper(unsigned int cp) {
+    /* The reverse of utf8_lower */
+    if((cp >= 'a') && (cp <= 'z')) return cp - 32;
+    if(cp < 0xe0) return cp;
+    if((cp <= 0xfe) && (cp != 0xf7)) return cp - 0x20;
+    if(cp == 0xff) return 0x178;
+    if(((cp >= 0x100) && (cp <= 0x12f)) || ((cp >= 0x132) && (cp <= 0x137)) ||
+            ((cp >= 0x14a) && (cp <= 0x177))) {
+        return cp & ~1U;
+    }
+    if(((cp >= 0x139) && (cp <= 0x148)) || ((cp >= 0x179) && (cp <= 0x17e))) {
+        return (cp & 1) ? cp : cp - 1;
+    }
+    if((cp >= 0x3b1) && (cp <= 0x3c9) && (cp != 0x3c2)) return cp - 0x20;
+    if((cp >= 0x430) && (cp <= 0x44f)) return cp - 0x20;
+    if((cp >= 0x450) && (cp <= 0x45f)) return cp - 0x50;
+    return cp;
+}
+
+int utf8_decode(const char *s, unsigned int *cp) {
+    /* Codepoint at s, returning the bytes it takes. A byte that doesn't
+     * start a valid (shortest form) sequence is one Latin-1 character. */
+    const unsigned char *u = (const unsigned char*)s;
+    int n = 0;
+    int i = 0;
+
+    *cp = u[0];
+    if(u[0] < 0x80) return 1;
+    if((u[0] & 0xe0) == 0xc0) {
+        n = 2;
+        *cp = u[0] & 0x1f;
+    } else if((u[0] & 0xf0) == 0xe0) {
+        n = 3;
+        *cp = u[0] & 0x0f;
+    } else if((u[0] & 0xf8) == 0xf0) {
+        n = 4;
+        *cp = u[0] & 0x07;
+    } else {
+        *cp = u[0];
+        return 1;
+    }
+    for(i = 1; i < n; i++) {
+        if((u[i] & 0xc0) != 0x80) {
+            *cp = u[0];
+            return 1;
+        }
+        *cp = (*cp << 6) | (u[i] & 0x3f);
+    }
+    if((*cp < ((n == 2) ? 0x80U : (n == 3) ? 0x800U : 0x10000U)) ||
+            (*cp > 0x10ffff)) {
+        *cp = u[0];
+        return 1;
+    }
+    return n;
+}
+
+int utf8_encode(unsigned int cp, char *out) {
+    // Write cp as UTF-8, returning its length (1 to 4)
+    if(cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if(cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if(cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+int mht_symbol(MHTable *ht, unsigned int cp, bool add) {
+    /* Symbol of codepoint cp, numbering it if it is new and add is set.
+     * -1 if it has no symbol (or there are no symbols left). */
+    int i = 0;
+    if(cp < 0x80) return cp;
+    if(cp < UTF8_DIRECT) {
+        if(ht->symof[cp]) return ht->symof[cp];
+    } else {
+        for(i = 0; i < ht->nsyms; i++) {
+            if(ht->syms[i] == cp) return 0x80 + i;
+        }
+    }
+    if(!add || (ht->nsyms == UTF8_SYMS)) return -1;
+    ht->syms[ht->nsyms] = cp;
+    if(cp < UTF8_DIRECT) ht->symof[cp] = 0x80 + ht->nsyms;
+    return 0x80 + ht->nsyms++;
+}
+
+void mht_index_symbols(MHTable *ht) {
+    // Fill the codepoint to symbol lookup from ht->syms
+    int i = 0;
+    memset(ht->symof, 0, sizeof(ht->symof));
+    for(i = 0; i < ht->nsyms; i++) {
+        if(ht->syms[i] < UTF8_DIRECT) ht->symof[ht->syms[i]] = 0x80 + i;
+    }
+}
+
+int markov_encode_word(MHTable *ht, char *word, bool add) {
+    /* Lowercase word and turn it into symbols, in place (a symbol is never
+     * longer than its codepoint). Returns the number of symbols, or -1 if a
+     * codepoint has no symbol, in which case word is left half done. */
+    unsigned int cp = 0;
+    int sym = 0;
+    int i = 0;
+    int n = 0;
+
+    while(word[i]) {
+        if(!(word[i] & 0x80)) {
+            word[n++] = tolower((unsigned char)word[i++]);
+            continue;
+        }
+        i += utf8_decode(word + i, &cp);
+        sym = mht_symbol(ht, utf8_lower(cp), add);
+        if(sym < 0) return -1;
+        word[n++] = sym;
+    }
+    word[n] = '\0';
+    return n;
+}
+
+int markov_decode_name(MHTable *ht, const char *syms, int n, char *out,
+        int cap, bool capital) {
+    /* Write n symbols to out as UTF-8, within cap bytes (with the '\0') and
+     * never splitting a character, with the first one uppercase if capital
+     * is set. Returns the bytes written. */
+    char buf[4];
+    unsigned int cp = 0;
+    int len = 0;
+    int m = 0;
+    int i = 0;
+
+    for(i = 0; i < n; i++) {
+        cp = (unsigned char)syms[i];
+        if((cp < 0x80) && (i || !capital)) {
+            if(len + 1 > cap - 1) break;
+            out[len++] = cp;
+            continue;
+        }
+        if(cp >= 0x80) cp = ht->syms[cp - 0x80];
+        if(capital && !i) cp = utf8_upper(cp);
+        m = utf8_encode(cp, buf);
+        if(len + m > cap - 1) break;
+        memcpy(out + len, buf, m);
+        len += m;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+void utf8_change_case(char *s, int len, bool upper, int from) {
+    /* Change the case of the characters of s (len bytes) from the from-th
+     * character on, in place. The letters utf8_lower and utf8_upper know
+     * take as many bytes in either case. */
+    unsigned int cp = 0;
+    unsigned int to = 0;
+    char buf[4];
+    int i = 0;
+    int n = 0;
+    int c = 0;
+
+    for(i = 0; i < len; i += n, c++) {
+        n = utf8_decode(s + i, &cp);
+        if(i + n > len) break;
+        if(c < from) continue;
+        to = upper ? utf8_upper(cp) : utf8_lower(cp);
+        if((to != cp) && (utf8_encode(to, buf) == n)) memcpy(s + i, buf, n);
+    }
+}
+
+void mht_map_symbols(char *key, unsigned char *map) {
+    // Renumber the symbols of a key through map
+    for(; *key; key++) {
+        if(*key & 0x80) *key = map[(unsigned char)*key];
+    }
+}
+
+bool mht_sort_symbols(MHTable *ht, unsigned char *map) {
+    /* Put the symbols in codepoint order, filling map (256 entries) with the
+     * new number of each old one. False if they already were. */
+    unsigned int syms[UTF8_SYMS];
+    bool moved = false;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+
+    for(i = 0; i < 0x80; i++) {
+        map[i] = i;
+    }
+    for(i = 0; i < ht->nsyms; i++) {
+        // Rank of symbol i among the codepoints
+        k = 0;
+        for(j = 0; j < ht->nsyms; j++) {
+            if(ht->syms[j] < ht->syms[i]) k++;
+        }
+        map[0x80 + i] = 0x80 + k;
+        syms[k] = ht->syms[i];
+        moved = moved || (k != i);
+    }
+    memcpy(ht->syms, syms, sizeof(unsigned int) * ht->nsyms);
+    mht_index_symbols(ht);
+    return moved;
+}
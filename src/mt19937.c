@@ -50,11 +50,17 @@
 #define UPPER_MASK 0x80000000UL /* most significant w-r bits */
 #define LOWER_MASK 0x7fffffffUL /* least significant r bits */
 
-static unsigned long mt[N]; /* the array for the state vector  */
-static int mti=N+1; /* mti==N+1 means mt[N] is not initialized */
+/* State used by the functions without a state argument (the originals) */
+static MTState mtdefault = { {0}, N+1 };
+
+/* The _r functions below are the original functions, taking the state as an
+ * argument so each thread can have its own. The mt and mti names are kept so
+ * the code reads the same as the reference implementation. */
+#define mt (st->mt)
+#define mti (st->mti)
 
 /* initializes mt[N] with a seed */
-void init_genrand(unsigned long s)
+void init_genrand_r(MTState *st, unsigned long s)
 {
     mt[0]= s & 0xffffffffUL;
     for (mti=1; mti<N; mti++) {
@@ -73,10 +79,10 @@ void init_genrand(unsigned long s)
 /* init_key is the array for initializing keys */
 /* key_length is its length */
 /* slight change for C++, 2004/2/26 */
-void init_by_array(unsigned long init_key[], int key_length)
+void init_by_array_r(MTState *st, unsigned long init_key[], int key_length)
 {
     int i, j, k;
-    init_genrand(19650218UL);
+    init_genrand_r(st, 19650218UL);
     i=1; j=0;
     k = (N>key_length ? N : key_length);
     for (; k; k--) {
@@ -99,7 +105,7 @@ void init_by_array(unsigned long init_key[], int key_length)
 }
 
 /* generates a random number on [0,0xffffffff]-interval */
-unsigned long genrand_int32(void)
+unsigned long genrand_int32_r(MTState *st)
 {
     unsigned long y;
     static unsigned long mag01[2]={0x0UL, MATRIX_A};
@@ -109,7 +115,7 @@ unsigned long genrand_int32(void)
         int kk;
 
         if (mti == N+1)   /* if init_genrand() has not been called, */
-            init_genrand(5489UL); /* a default initial seed is used */
+            init_genrand_r(st, 5489UL); /* a default initial seed is used */
 
         for (kk=0;kk<N-M;kk++) {
             y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
@@ -136,6 +142,24 @@ unsigned long genrand_int32(void)
     return y;
 }
 
+#undef mt
+#undef mti
+
+void init_genrand(unsigned long s)
+{
+    init_genrand_r(&mtdefault, s);
+}
+
+void init_by_array(unsigned long init_key[], int key_length)
+{
+    init_by_array_r(&mtdefault, init_key, key_length);
+}
+
+unsigned long genrand_int32(void)
+{
+    return genrand_int32_r(&mtdefault);
+}
+
 /* generates a random number on [0,0x7fffffff]-interval */
 long genrand_int31(void)
 {
@@ -185,14 +209,15 @@ int mt_rand_lim(int limit) {
      * skew. Like trying to split ten candies with 3 kids - and not being able
      * to cut anything into smaller pieces. A single piece will be left over...
      * This takes the candy, divides it by 3, and if the result is greater than
-     * 3 puts it back into the bucket. */
-    int divisor = RAND_MAX/(limit + 1);
-    int retval;
+     * 3 puts it back into the bucket. The bucket is the generator's 32 bit
+     * range, not RAND_MAX, which is much smaller on some systems. */
+    unsigned long divisor = 0xffffffffUL / ((unsigned long)limit + 1);
+    unsigned long retval;
     do {
         retval = genrand_int32() / divisor;
-    } while (retval > limit);
+    } while (retval > (unsigned long)limit);
 
-    return retval;
+    return (int)retval;
 }
 
 int mt_rand(int min, int max) {
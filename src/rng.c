@@ -0,0 +1,198 @@
+/*
+* Markov Generator
+* Copyright (C) Zach Wilder 2023
+* 
+* This file is a part of Markov Generator
+*
+* Markov Generator is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+* 
+* Markov Generator is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU General Public License
+* along with Markov Generator.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <rng.h>
+#include <string.h>
+
+static RngKind rng_default = RNG_XOSHIRO; // See rng_set_default
+
+void rng_set_default(RngKind kind) {
+    /* Backend rng_seed uses from now on. Meant to be set once, from the
+     * command line, before any thread seeds its generator. */
+    rng_default = kind;
+}
+
+RngKind rng_get_default(void) {
+    return rng_default;
+}
+
+int rng_kind_from_name(char *name, RngKind *kind) {
+    // "mt", "xoshiro" or "philox", -1 for anything else
+    if(!strcmp(name, "mt")) {
+        *kind = RNG_MT;
+    } else if(!strcmp(name, "philox")) {
+        *kind = RNG_PHILOX;
+    } else if(!strcmp(name, "xoshiro")) {
+        *kind = RNG_XOSHIRO;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t rng_splitmix(uint64_t *x) {
+    // SplitMix64, only used to spread a seed over the xoshiro states
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(Rng *r, unsigned long seed, unsigned long stream) {
+    rng_seed_kind(r, rng_default, seed, stream);
+}
+
+void rng_seed_kind(Rng *r, RngKind kind, unsigned long seed,
+        unsigned long stream) {
+    /* Seed r from a seed and a stream number. Different streams of the same
+     * seed give unrelated sequences, so threads (or blocks of work) can each
+     * take their own stream. With Philox, seeding is free and stream k is
+     * the same whatever happened before, so it can be reseeded per name. */
+    unsigned long key[2];
+    uint64_t x = 0;
+    uint64_t z = 0;
+    int i = 0;
+
+    r->kind = kind;
+    r->pos = RNGBLOCK;
+    if(kind == RNG_MT) {
+        key[0] = seed & 0xffffffffUL;
+        key[1] = stream & 0xffffffffUL;
+        init_by_array_r(&(r->st.mt), key, 2);
+        return;
+    }
+    if(kind == RNG_PHILOX) {
+        r->st.ph.key[0] = (uint32_t)seed;
+        r->st.ph.key[1] = (uint32_t)((uint64_t)seed >> 32);
+        r->st.ph.ctr[0] = 0;
+        r->st.ph.ctr[1] = 0;
+        r->st.ph.ctr[2] = (uint32_t)stream;
+        r->st.ph.ctr[3] = (uint32_t)((uint64_t)stream >> 32);
+        return;
+    }
+    // SplitMix64 over (seed, stream), which never leaves a lane all zero in
+    // practice; a zero lane is patched anyway since it would stay zero
+    x = ((uint64_t)seed << 32) ^ (uint64_t)seed ^
+        ((uint64_t)stream * 0xd1342543de82ef95ULL);
+    for(i = 0; i < RNG_LANES; i++) {
+        z = rng_splitmix(&x);
+        r->st.xo[0][i] = (uint32_t)z;
+        r->st.xo[1][i] = (uint32_t)(z >> 32);
+        z = rng_splitmix(&x);
+        r->st.xo[2][i] = (uint32_t)z;
+        r->st.xo[3][i] = (uint32_t)(z >> 32);
+        if(!(r->st.xo[0][i] | r->st.xo[1][i] | r->st.xo[2][i] | r->st.xo[3][i])) {
+            r->st.xo[0][i] = 1;
+        }
+    }
+}
+
+static inline uint32_t rng_rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+static void rng_fill_xoshiro(Rng *r) {
+    /* xoshiro128++ (Blackman and Vigna), one step of every lane per round.
+     * The lanes are independent and laid out word major, so the inner loop
+     * is plain element-wise arithmetic over small arrays. */
+    uint32_t (*s)[RNG_LANES] = r->st.xo;
+    uint32_t t[RNG_LANES];
+    int i = 0;
+    int j = 0;
+
+    for(i = 0; i < RNGBLOCK; i += RNG_LANES) {
+        for(j = 0; j < RNG_LANES; j++) {
+            r->buf[i + j] = rng_rotl(s[0][j] + s[3][j], 7) + s[0][j];
+            t[j] = s[1][j] << 9;
+            s[2][j] ^= s[0][j];
+            s[3][j] ^= s[1][j];
+            s[1][j] ^= s[2][j];
+            s[0][j] ^= s[3][j];
+            s[2][j] ^= t[j];
+            s[3][j] = rng_rotl(s[3][j], 11);
+        }
+    }
+}
+
+static void rng_fill_philox(Rng *r) {
+    /* Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as
+     * 1, 2, 3") of the counter, into the last four slots of the buffer, then
+     * the counter moves on. Ten rounds of two 32x32->64 multiplies. */
+    uint32_t k0 = r->st.ph.key[0];
+    uint32_t k1 = r->st.ph.key[1];
+    uint32_t c0 = r->st.ph.ctr[0];
+    uint32_t c1 = r->st.ph.ctr[1];
+    uint32_t c2 = r->st.ph.ctr[2];
+    uint32_t c3 = r->st.ph.ctr[3];
+    uint64_t p0 = 0;
+    uint64_t p1 = 0;
+    int i = 0;
+
+    for(i = 0; i < 10; i++) {
+        p0 = (uint64_t)0xd2511f53U * c0;
+        p1 = (uint64_t)0xcd9e8d57U * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        k0 += 0x9e3779b9U;
+        k1 += 0xbb67ae85U;
+    }
+    r->buf[RNGBLOCK - 4] = c0;
+    r->buf[RNGBLOCK - 3] = c1;
+    r->buf[RNGBLOCK - 2] = c2;
+    r->buf[RNGBLOCK - 1] = c3;
+    r->pos = RNGBLOCK - 4;
+    if(!++r->st.ph.ctr[0]) r->st.ph.ctr[1]++;
+}
+
+void rng_refill(Rng *r) {
+    // Make the next block of numbers
+    int i = 0;
+    if(r->kind == RNG_PHILOX) {
+        rng_fill_philox(r);
+        return;
+    } else if(r->kind == RNG_MT) {
+        // Same sequence as drawing from MT19937 one number at a time
+        for(i = 0; i < RNGBLOCK; i++) {
+            r->buf[i] = (uint32_t)genrand_int32_r(&(r->st.mt));
+        }
+    } else {
+        rng_fill_xoshiro(r);
+    }
+    r->pos = 0;
+}
+
+int rng_below(Rng *r, int n) {
+    /* Random number in [0, n), by Lemire's multiply and shift: the top half
+     * of x * n is the answer, and the low half tells whether x fell in the
+     * sliver that would favour some answers. Only then is the threshold
+     * (one division) worked out and x possibly drawn again. */
+    uint64_t m = (uint64_t)rng_u32(r) * (uint32_t)n;
+    uint32_t low = (uint32_t)m;
+    uint32_t threshold = 0;
+    if(low < (uint32_t)n) {
+        threshold = -(uint32_t)n % (uint32_t)n;
+        while(low < threshold) {
+            m = (uint64_t)rng_u32(r) * (uint32_t)n;
+            low = (uint32_t)m;
+        }
+    }
+    return (int)(m >> 32);
+}
@@ -19,6 +19,7 @@
 */
 
 #include <slist.h>
+#include <ctype.h>
 
 /*******
  * SList
@@ -40,6 +41,16 @@ SList* create_slist(char *s) {
     return node;
 }
 
+SList* create_slist_arena(Arena *a, char *s) {
+    /* Create a SList node with the node and string allocated from arena a.
+     * Lists made this way are freed with the arena, never destroy_slist. */
+    SList *node = arena_alloc(a, sizeof(SList));
+    node->data = arena_strdup(a, s);
+    node->length = strlen(s);
+    node->next = NULL;
+    return node;
+}
+
 SList* create_slist_blank(int strsize) {
     /* Create a node and allocate the memory for the string, but don't assign
      * anything to the string yet */
@@ -109,11 +120,14 @@ void slist_push_node(SList **head, SList *s) {
 }
 
 int slist_count(SList *node) {
-    /* Count and return the number of nodes in the SList */
-    if(!node) {
-        return 0;
+    /* Count and return the number of nodes in the SList. Not recursive, so
+     * long lists don't run out of stack. */
+    int result = 0;
+    while(node) {
+        result++;
+        node = node->next;
     }
-    return slist_count(node->next) + 1;
+    return result;
 }
 
 int slist_count_chars(SList *node, bool incSpace) {
@@ -311,32 +325,52 @@ int slist_get_min(SList *s) {
 }
 
 SList* slist_load_dataset(char *fname) {
+    return slist_load_dataset_arena(fname, NULL);
+}
+
+SList* slist_load_dataset_arena(char *fname, Arena *a) {
+    /* Read the whitespace separated words in fname into an SList. The file is
+     * read in large blocks, words can be any length, and the tail of the list
+     * is kept so each word is linked on without walking the list. If a is not
+     * NULL the list is allocated from it. */
     if(!fname) return NULL;
-    FILE *f = fopen(fname, "r+");
+    FILE *f = fopen(fname, "r");
     if(!f) return NULL;
     SList *words = NULL;
-    char buf[100];
-    int in = fgetc(f);
-    int i = 0;
+    SList *tail = NULL;
+    SList *node = NULL;
+    char block[65536];
+    char *buf = NULL;
+    size_t n = 0;
+    size_t i = 0;
+    int len = 0;
+    int cap = 0;
 
     // Read file, store words in SList
-    while(in != EOF) {
-        if((in == ' ') || (in == '\n')) {
-            // End of word
-            buf[i] = '\0';
-            slist_push(&words, buf);
-            i = 0;
-        } else { 
-            buf[i] = (char)in;
-            i++;
+    do {
+        n = fread(block, 1, sizeof(block), f);
+        for(i = 0; i <= n; i++) {
+            if((i < n) && !isspace((unsigned char)block[i])) {
+                if(len + 1 >= cap) {
+                    cap = cap ? cap * 2 : 64;
+                    buf = realloc(buf, cap);
+                }
+                buf[len++] = block[i];
+            } else if(len && ((i < n) || !n)) {
+                // End of word (or, at the end of the file, the last word)
+                buf[len] = '\0';
+                node = a ? create_slist_arena(a, buf) : create_slist(buf);
+                if(tail) {
+                    tail->next = node;
+                } else {
+                    words = node;
+                }
+                tail = node;
+                len = 0;
+            }
         }
-        in = fgetc(f);
-    }
-    if((buf[i] != '\0') && (i > 0)) {
-        // Don't miss the last word in the dataset
-        buf[i] = '\0';
-        slist_push(&words, buf);
-    }
+    } while(n);
+    free(buf);
     fclose(f);
     return words;
 }